@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <string.h>
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <net/socket.h>
+#include <nrf_socket.h>
+#include "dns_cache.h"
+#include "event_loop.h"
+#include <logging/log.h>
+
+LOG_MODULE_REGISTER(dns_cache, DNS_CACHE_LOG_LEVEL);
+
+#define HOSTNAME_SIZE CONFIG_DNS_CACHE_MAX_HOSTNAME_SIZE
+
+int url_parse_host(const char *url, char *host, size_t len);
+
+struct dns_cache_entry {
+	/** Resolved hostname, null-terminated. Empty if the entry is unused. */
+	char host[HOSTNAME_SIZE];
+	/** Access point name the host was resolved on. */
+	char apn[IFNAMSIZ];
+	/** Address family of the answer. */
+	int family;
+	/** The answer. */
+	struct sockaddr addr;
+	/** Uptime after which the answer is dropped, in milliseconds. */
+	int64_t expires;
+};
+
+static struct dns_cache_entry cache[CONFIG_DNS_CACHE_ENTRIES];
+static K_MUTEX_DEFINE(cache_lock);
+
+static struct {
+	char host[HOSTNAME_SIZE];
+	int family;
+	const char *apn;
+} prefetch;
+
+static bool entry_match(const struct dns_cache_entry *e, const char *host,
+			int family, const char *apn)
+{
+	return (e->family == family) &&
+	       (strcmp(e->host, host) == 0) &&
+	       (strcmp(e->apn, apn ? apn : "") == 0);
+}
+
+/* Must be called with the cache locked */
+static struct dns_cache_entry *entry_find(const char *host, int family,
+					  const char *apn)
+{
+	int64_t now = k_uptime_get();
+
+	for (size_t i = 0; i < ARRAY_SIZE(cache); i++) {
+		if (cache[i].host[0] == '\0') {
+			continue;
+		}
+		if (cache[i].expires <= now) {
+			/* Stale, make room */
+			cache[i].host[0] = '\0';
+			continue;
+		}
+		if (entry_match(&cache[i], host, family, apn)) {
+			return &cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Must be called with the cache locked */
+static void entry_store(const char *host, int family, const char *apn,
+			const struct sockaddr *sa)
+{
+	struct dns_cache_entry *e = NULL;
+
+	/* Reuse the entry for this host if any, then a free one,
+	 * and as a last resort the one closest to expiring.
+	 */
+	for (size_t i = 0; i < ARRAY_SIZE(cache) && !e; i++) {
+		if (cache[i].host[0] != '\0' &&
+		    entry_match(&cache[i], host, family, apn)) {
+			e = &cache[i];
+		}
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(cache) && !e; i++) {
+		if (cache[i].host[0] == '\0') {
+			e = &cache[i];
+		}
+	}
+	if (!e) {
+		e = &cache[0];
+		for (size_t i = 1; i < ARRAY_SIZE(cache); i++) {
+			if (cache[i].expires < e->expires) {
+				e = &cache[i];
+			}
+		}
+	}
+
+	strcpy(e->host, host);
+	strncpy(e->apn, apn ? apn : "", sizeof(e->apn) - 1);
+	e->apn[sizeof(e->apn) - 1] = '\0';
+	e->family = family;
+	e->addr = *sa;
+	e->expires = k_uptime_get() + CONFIG_DNS_CACHE_LIFETIME_MS;
+}
+
+static int resolve(const char *hostname, int family, const char *apn,
+		   struct sockaddr *sa)
+{
+	int err;
+	struct addrinfo *ai;
+
+	struct addrinfo hints = {
+		.ai_family = family,
+		.ai_next = apn ?
+			&(struct addrinfo) {
+				.ai_family    = AF_LTE,
+				.ai_socktype  = SOCK_MGMT,
+				.ai_protocol  = NPROTO_PDN,
+				.ai_canonname = (char *)apn
+			} : NULL,
+	};
+
+	err = getaddrinfo(hostname, NULL, &hints, &ai);
+	if (err) {
+		LOG_WRN("Failed to resolve hostname %s",
+			log_strdup(hostname));
+		return -EHOSTUNREACH;
+	}
+
+	*sa = *(ai->ai_addr);
+	freeaddrinfo(ai);
+
+	return 0;
+}
+
+int dns_cache_lookup(const char *host, int family, const char *apn,
+		     struct sockaddr *sa)
+{
+	int err;
+	struct dns_cache_entry *e;
+	char hostname[HOSTNAME_SIZE];
+
+	if (host == NULL || sa == NULL) {
+		return -EINVAL;
+	}
+
+	/* Extract the hostname, without protocol or port */
+	err = url_parse_host(host, hostname, sizeof(hostname));
+	if (err) {
+		return err;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	e = entry_find(hostname, family, apn);
+	if (e) {
+		*sa = e->addr;
+		k_mutex_unlock(&cache_lock);
+		LOG_DBG("Cache hit for %s", log_strdup(hostname));
+		return 0;
+	}
+	k_mutex_unlock(&cache_lock);
+
+	LOG_DBG("Cache miss for %s", log_strdup(hostname));
+
+	/* Resolve without holding the lock, this may take seconds */
+	err = resolve(hostname, family, apn, sa);
+	if (err) {
+		return err;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	entry_store(hostname, family, apn, sa);
+	k_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+static void prefetch_handler(struct k_work *work)
+{
+	struct sockaddr sa;
+	char hostname[HOSTNAME_SIZE];
+	const char *apn;
+	int family;
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	strcpy(hostname, prefetch.host);
+	family = prefetch.family;
+	apn = prefetch.apn;
+	prefetch.host[0] = '\0';
+	k_mutex_unlock(&cache_lock);
+
+	if (hostname[0] == '\0') {
+		return;
+	}
+
+	(void)dns_cache_lookup(hostname, family, apn, &sa);
+}
+
+/* Resolved on the event loop work queue, with the other blocking work */
+static K_WORK_DEFINE(prefetch_work, prefetch_handler);
+
+int dns_cache_prefetch(const char *host, int family, const char *apn)
+{
+	int err;
+	char hostname[HOSTNAME_SIZE];
+
+	if (host == NULL) {
+		return -EINVAL;
+	}
+
+	err = url_parse_host(host, hostname, sizeof(hostname));
+	if (err) {
+		return err;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	if (entry_find(hostname, family, apn)) {
+		k_mutex_unlock(&cache_lock);
+		return 0;
+	}
+	/* Supersede any request that has not been picked up yet */
+	strcpy(prefetch.host, hostname);
+	prefetch.family = family;
+	prefetch.apn = apn;
+	k_mutex_unlock(&cache_lock);
+
+	event_loop_work_submit(&prefetch_work);
+
+	return 0;
+}
+
+void dns_cache_flush(void)
+{
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	for (size_t i = 0; i < ARRAY_SIZE(cache); i++) {
+		cache[i].host[0] = '\0';
+	}
+	k_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file dns_cache.h
+ *
+ * @defgroup dns_cache Resolver cache
+ * @{
+ * @brief Hostname resolver cache shared by the download and upload clients.
+ *
+ * @details The resolver cache provides APIs for:
+ *  - resolving a hostname, reusing a previous answer for a fixed lifetime,
+ *  - resolving a hostname in the background ahead of its first use,
+ *  - discarding all cached answers.
+ *
+ * The cache is not TTL-aware: getaddrinfo() does not report the record
+ * TTL, so every answer is kept for the same
+ * @option{CONFIG_DNS_CACHE_LIFETIME_MS} after it was obtained, whatever
+ * the TTL of its record.
+ */
+
+#ifndef DNS_CACHE_H__
+#define DNS_CACHE_H__
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <net/socket.h>
+
+/* Specified here as these are not defined in prj.conf */
+#define CONFIG_DNS_CACHE_ENTRIES 4
+#define CONFIG_DNS_CACHE_LIFETIME_MS (5 * 60 * MSEC_PER_SEC)
+#define CONFIG_DNS_CACHE_MAX_HOSTNAME_SIZE 64
+
+#define DNS_CACHE_LOG_LEVEL 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Resolve the host part of a URL.
+ *
+ * A cached answer is returned if it is younger than
+ * @option{CONFIG_DNS_CACHE_LIFETIME_MS}, otherwise the host
+ * is resolved with getaddrinfo() and the answer is cached.
+ *
+ * @param[in]  host	URL or name of the host, null-terminated.
+ *			Scheme, port and path are ignored.
+ * @param[in]  family	Address family, AF_INET or AF_INET6.
+ * @param[in]  apn	Access point name to resolve on, or NULL.
+ * @param[out] sa	Resolved address. The port is left unset.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int dns_cache_lookup(const char *host, int family, const char *apn,
+		     struct sockaddr *sa);
+
+/**
+ * @brief Resolve the host part of a URL in the background.
+ *
+ * The request is queued on the event loop work queue and the call returns
+ * immediately. Only the most recent request is kept while the resolver
+ * is busy.
+ *
+ * @param[in] host	URL or name of the host, null-terminated.
+ * @param[in] family	Address family, AF_INET or AF_INET6.
+ * @param[in] apn	Access point name to resolve on, or NULL.
+ *			Must stay valid until the lookup has run.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int dns_cache_prefetch(const char *host, int family, const char *apn);
+
+/**
+ * @brief Discard all cached answers.
+ */
+void dns_cache_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DNS_CACHE_H__ */
+
+/**@} */
@@ -10,520 +10,631 @@
 #include <zephyr/types.h>
 #include <toolchain/common.h>
 #include <net/socket.h>
-#include <nrf_socket.h>
-#include <net/tls_credentials.h>
 #include "download_client_speedtest.h"
+#include "event_loop.h"
+#include "transport.h"
+#include "hrtime.h"
 #include <logging/log.h>
 
 LOG_MODULE_REGISTER(download_client_speedtest, DOWNLOAD_CLIENT_SPEEDTEST_LOG_LEVEL);
 
-#define SIN6(A) ((struct sockaddr_in6 *)(A))
-#define SIN(A) ((struct sockaddr_in *)(A))
+int url_parse_file(const char *url, char *file, size_t len);
 
-#define HOSTNAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_HOSTNAME_SIZE
+int http_parse(struct download_client *client, size_t len);
+int http_get_request_send(struct download_client *client, size_t from);
+int http_request_flush(struct download_client *client);
+void http_request_init(struct download_client *client);
+bool http_sink_active(const struct download_client *client);
 
-int url_parse_port(const char *url, uint16_t *port);
-int url_parse_proto(const char *url, int *proto, int *type);
-int url_parse_host(const char *url, char *host, size_t len);
+static int file_done(struct download_client *dl);
+static int download_process(struct download_client *dl, size_t len);
 
-int http_parse(struct download_client *client, size_t len);
-int http_get_request_send(struct download_client *client);
+/* Held by a reconnect while it runs, so that it is not disconnected
+ * under it.
+ */
+static K_MUTEX_DEFINE(reconnect_lock);
 
-static const char *str_family(int family)
+/* Time the first request of the download once the socket has taken
+ * all of it. Requests for later fragments are part of the transfer.
+ */
+static void request_sent_mark(struct download_client *dl)
 {
-	switch (family) {
-	case AF_INET:
-		return "IPv4";
-	case AF_INET6:
-		return "IPv6";
-	default:
-		__ASSERT(false, "Unsupported family");
-		return NULL;
+	if (!dl->http.request_pending &&
+	    !transport_timing_reached(&dl->timing,
+				      TRANSPORT_PHASE_REQUEST_SENT)) {
+		transport_timing_mark(&dl->timing, TRANSPORT_PHASE_REQUEST_SENT);
 	}
 }
 
-static int socket_timeout_set(int fd)
+static int request_send(struct download_client *dl)
 {
 	int err;
 
-	if (CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS == SYS_FOREVER_MS) {
-		return 0;
+	switch (dl->proto) {
+		case IPPROTO_TCP:
+		case IPPROTO_TLS_1_2: {
+			err = http_get_request_send(dl, dl->progress);
+			if (!err) {
+				request_sent_mark(dl);
+			}
+			return err;
+		}
+		case IPPROTO_UDP:
+		case IPPROTO_DTLS_1_2:
+			break;
 	}
 
-	const uint32_t timeout_ms = CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS;
+	return 0;
+}
+
+static int error_evt_send(const struct download_client *dl, int error)
+{
+	/* Error will be sent as negative. */
+	__ASSERT_NO_MSG(error > 0);
+
+	const struct download_client_evt evt = {
+		.id = DOWNLOAD_CLIENT_EVT_ERROR,
+		.error = -error
+	};
+
+	return dl->callback(&evt);
+}
 
-	struct timeval timeo = {
-		.tv_sec = (timeout_ms / 1000),
-		.tv_usec = (timeout_ms % 1000) * 1000,
+static int payload_evt_send(struct download_client *client,
+			    const void *buf, size_t len)
+{
+	const struct download_client_evt evt = {
+		.id = DOWNLOAD_CLIENT_EVT_FRAGMENT,
+		.fragment = {
+			.buf = buf,
+			.len = len,
+		}
 	};
 
-	LOG_INF("Configuring socket timeout (%ld s)", timeo.tv_sec);
+	return client->callback(&evt);
+}
 
-	err = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
-	if (err) {
-		LOG_WRN("Failed to set socket timeout, errno %d", errno);
-		return -errno;
+/* Timestamp payload bytes as they are handed on */
+static void payload_mark(struct download_client *dl, size_t len)
+{
+	if (len == 0) {
+		return;
 	}
 
-	return 0;
+	if (!transport_timing_reached(&dl->timing,
+				      TRANSPORT_PHASE_FIRST_BYTE)) {
+		transport_timing_mark(&dl->timing, TRANSPORT_PHASE_FIRST_BYTE);
+	}
+	transport_timing_mark(&dl->timing, TRANSPORT_PHASE_LAST_BYTE);
 }
 
-#ifdef USE_SEC_TAG_ARRAY
-static int socket_sectag_set(int fd, uint32_t* sec_tag_array, int sec_tag_array_sz)
-#else
-static int socket_sectag_set(int fd, int sec_tag)	
-#endif
+static int fragment_evt_send(struct download_client *client)
 {
-	int err;
-	int verify;
-#ifndef USE_SEC_TAG_ARRAY
-	sec_tag_t sec_tag_list[] = { sec_tag };
-#endif
+	__ASSERT(client->offset <= CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
+		 "Buffer overflow!");
 
-	enum {
-		NONE = 0,
-		OPTIONAL = 1,
-		REQUIRED = 2,
-	};
+	payload_mark(client, client->offset);
 
-	verify = REQUIRED;
+	return payload_evt_send(client, client->buf, client->offset);
+}
 
-	err = setsockopt(fd, SOL_TLS, TLS_PEER_VERIFY, &verify, sizeof(verify));
-	if (err) {
-		LOG_ERR("Failed to setup peer verification, errno %d", errno);
-		return -errno;
-	}
+/* Files of the sequence after the current one */
+static size_t files_left(const struct download_client *dl)
+{
+	return dl->files_count - dl->file_index - 1;
+}
 
-#ifdef USE_SEC_TAG_ARRAY
-	LOG_INF("Setting up TLS credentials array");
-	err = setsockopt(fd, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_array,
-			 sizeof(sec_tag_t) * sec_tag_array_sz);
-#else
-	LOG_INF("Setting up TLS credentials, tag %d", sec_tag);
-	err = setsockopt(fd, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list,
-			 sizeof(sec_tag_t) * ARRAY_SIZE(sec_tag_list));
-#endif	
-	if (err) {
-		LOG_ERR("Failed to setup socket security tag, errno %d", errno);
-		return -errno;
-	}
+static int done_evt_send(const struct download_client *dl)
+{
+	const struct download_client_evt evt = {
+		.id = DOWNLOAD_CLIENT_EVT_DONE,
+		.files_left = files_left(dl),
+	};
 
-	return 0;
+	LOG_INF("Download complete");
+
+	return dl->callback(&evt);
 }
 
-static int socket_apn_set(int fd, const char *apn)
+/* Account payload bytes in sink mode, and notify the application
+ * once enough have accumulated or the file is complete.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int sink_account(struct download_client *dl, size_t len)
 {
-	int err;
-	size_t len;
+	int rc;
+	size_t notify = dl->config.sink_notify_bytes ?
+		dl->config.sink_notify_bytes :
+		CONFIG_DOWNLOAD_CLIENT_SINK_NOTIFY_BYTES;
 
-	__ASSERT_NO_MSG(apn);
+	payload_mark(dl, len);
 
-	len = strlen(apn);
-	if (len >= IFNAMSIZ) {
-		LOG_ERR("Access point name is too long.");
-		return -EINVAL;
+	dl->sink_pending += len;
+
+	if ((dl->sink_pending < notify) && (dl->progress != dl->file_size)) {
+		return 0;
 	}
 
-	LOG_INF("Setting up APN: %s", log_strdup(apn));
+	rc = payload_evt_send(dl, NULL, dl->sink_pending);
+	dl->sink_pending = 0;
+	if (rc) {
+		LOG_INF("Fragment refused, download stopped.");
+		return rc;
+	}
 
-	err = setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, apn, len);
-	if (err) {
-		LOG_ERR("Failed to bind socket to network \"%s\", err %d",
-			log_strdup(apn), errno);
-		return -ENETUNREACH;
+	if (dl->progress == dl->file_size) {
+		return file_done(dl);
 	}
 
 	return 0;
 }
 
-static int host_lookup(const char *host, int family, const char *apn,
-		       struct sockaddr *sa)
+/* Count payload received in sink mode, at p. Bytes past the end of the
+ * file begin the response for the next file when it was requested
+ * ahead, they are moved to the start of the buffer for it.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int sink_take(struct download_client *dl, const char *p, size_t len)
 {
-	int err;
-	struct addrinfo *ai;
-	char hostname[HOSTNAME_SIZE];
-
-	struct addrinfo hints = {
-		.ai_family = family,
-		.ai_next = apn ?
-			&(struct addrinfo) {
-				.ai_family    = AF_LTE,
-				.ai_socktype  = SOCK_MGMT,
-				.ai_protocol  = NPROTO_PDN,
-				.ai_canonname = (char *)apn
-			} : NULL,
-	};
+	size_t extra = 0;
 
-	/* Extract the hostname, without protocol or port */
-	err = url_parse_host(host, hostname, sizeof(hostname));
-	if (err) {
-		return err;
+	if (dl->file_size && (len > dl->file_size - dl->progress)) {
+		extra = len - (dl->file_size - dl->progress);
+		len -= extra;
 	}
 
-	err = getaddrinfo(hostname, NULL, &hints, &ai);
-	if (err) {
-		LOG_WRN("Failed to resolve hostname %s on %s",
-			log_strdup(hostname), str_family(family));
-		return -EHOSTUNREACH;
+	dl->progress += len;
+	throughput_add(&dl->throughput, len);
+
+	if (extra && dl->next_requested) {
+		memmove(dl->buf, p + len, extra);
+		dl->offset = extra;
 	}
 
-	*sa = *(ai->ai_addr);
-	freeaddrinfo(ai);
+	return sink_account(dl, len);
+}
 
-	return 0;
+static int client_connect(struct download_client *dl)
+{
+	struct transport_cfg cfg = {
+		.apn = dl->config.apn,
+#ifdef USE_SEC_TAG_ARRAY
+		.sec_tag_array = dl->config.sec_tag_array,
+		.sec_tag_array_sz = dl->config.sec_tag_array_sz,
+#else
+		.sec_tag_array = (dl->config.sec_tag != -1) ?
+				 &dl->config.sec_tag : NULL,
+		.sec_tag_array_sz = 1,
+#endif
+		.session_cache = dl->config.session_cache,
+	};
+
+	return transport_connect(&dl->url, &cfg, &dl->proto, &dl->fd,
+				 &dl->timing);
 }
 
-static int client_connect(struct download_client *dl, const char *host,
-			  struct sockaddr *sa, int *fd)
+static int socket_close(struct download_client *dl)
 {
 	int err;
-	int type;
-	uint16_t port;
-	socklen_t addrlen;
 
-	err = url_parse_proto(host, &dl->proto, &type);
+	err = close(dl->fd);
 	if (err) {
-		LOG_DBG("Protocol not specified, defaulting to HTTP(S)");
-		type = SOCK_STREAM;
-#ifdef USE_SEC_TAG_ARRAY
-		if (dl->config.sec_tag_array != NULL) {
-#else
-		if (dl->config.sec_tag != -1) {
-#endif			
-			dl->proto = IPPROTO_TLS_1_2;
-		} else {
-			dl->proto = IPPROTO_TCP;
-		}
+		LOG_ERR("Failed to close socket, errno %d", errno);
+		return -errno;
 	}
 
-	if (dl->proto == IPPROTO_UDP || dl->proto == IPPROTO_DTLS_1_2) {
-		return -EPROTONOSUPPORT;
-	}
-	
+	dl->fd = -1;
 
-	if (dl->proto == IPPROTO_TLS_1_2 || dl->proto == IPPROTO_DTLS_1_2) {
-#ifdef USE_SEC_TAG_ARRAY
-		if (dl->config.sec_tag_array == NULL) {
-#else
-		if (dl->config.sec_tag == -1) {		
-#endif	
-			LOG_WRN("No security tag provided for TLS/DTLS");
-			return -EINVAL;
-		}
-	}
+	return 0;
+}
 
-	err = url_parse_port(host, &port);
-	if (err) {
-		switch (dl->proto) {
-		case IPPROTO_TLS_1_2:
-			port = 443;
-			break;
-		case IPPROTO_TCP:
-			port = 80;
-			break;
-		case IPPROTO_DTLS_1_2:
-			port = 5684;
-			break;
-		case IPPROTO_UDP:
-			port = 5683;
-			break;
-		}
-		LOG_DBG("Port not specified, using default: %d", port);
-	}
+/* Close the socket and connect again. Resolving and connecting block,
+ * so this runs on the event loop work queue while the session idles.
+ * The handler goes on once the work wakes the session.
+ */
+static void reconnect_start(struct download_client *dl)
+{
+	LOG_INF("Reconnecting..");
 
-	switch (sa->sa_family) {
-	case AF_INET6:
-		SIN6(sa)->sin6_port = htons(port);
-		addrlen = sizeof(struct sockaddr_in6);
-		break;
-	case AF_INET:
-		SIN(sa)->sin_port = htons(port);
-		addrlen = sizeof(struct sockaddr_in);
-		break;
-	default:
-		return -EAFNOSUPPORT;
+	/* A request sent ahead is lost with the connection */
+	if (dl->next_requested) {
+		dl->next_requested = false;
+		url_parse_file(dl->file, dl->url.path, sizeof(dl->url.path));
+		http_request_init(dl);
 	}
+	dl->http.request_pending = false;
 
-	LOG_DBG("family: %d, type: %d, proto: %d",
-		sa->sa_family, type, dl->proto);
+	dl->reconnecting = true;
+	dl->reconnect_done = false;
+	event_loop_work_submit(&dl->reconnect_work);
+}
 
-	*fd = socket(sa->sa_family, type, dl->proto);
-	if (*fd < 0) {
-		LOG_ERR("Failed to create socket, err %d", errno);
-		return -errno;
-	}
+static void reconnect_work_handler(struct k_work *work)
+{
+	int err;
+	struct download_client *const dl =
+		CONTAINER_OF(work, struct download_client, reconnect_work);
 
-	if (dl->config.apn != NULL && strlen(dl->config.apn)) {
-		err = socket_apn_set(*fd, dl->config.apn);
-		if (err) {
-			goto cleanup;
-		}
+	k_mutex_lock(&reconnect_lock, K_FOREVER);
+	if (!dl->reconnecting) {
+		/* Disconnected meanwhile */
+		k_mutex_unlock(&reconnect_lock);
+		return;
 	}
 
-	if ((dl->proto == IPPROTO_TLS_1_2 || dl->proto == IPPROTO_DTLS_1_2)
-#ifdef USE_SEC_TAG_ARRAY
-	     && (dl->config.sec_tag_array != NULL)) {
-		err = socket_sectag_set(*fd, dl->config.sec_tag_array, dl->config.sec_tag_array_sz);
-#else
-		 && (dl->config.sec_tag != -1)) {
-		err = socket_sectag_set(*fd, dl->config.sec_tag);		
-#endif
-		if (err) {
-			goto cleanup;
-		}
+	err = socket_close(dl);
+	if (!err) {
+		/* Same host, no need to parse its URL again */
+		err = client_connect(dl);
 	}
 
-	LOG_INF("Connecting to %s", log_strdup(host));
-	LOG_DBG("fd %d, addrlen %d, fam %s, port %d",
-		*fd, addrlen, str_family(sa->sa_family), port);
+	dl->reconnect_err = err;
+	dl->reconnect_done = true;
+	dl->session.fd = dl->fd;
 
-	err = connect(*fd, sa, addrlen);
-	if (err) {
-		LOG_ERR("Unable to connect, errno %d", errno);
-		err = -errno;
-	}
+	/* Wake the session to go on from the event loop */
+	event_loop_session_set(&dl->session, 0, k_uptime_get());
+	k_mutex_unlock(&reconnect_lock);
+}
 
-cleanup:
-	if (err) {
-		/* Unable to connect, close socket */
-		close(*fd);
-		*fd = -1;
+/* Stop a reconnect that has yet to run, or wait for the one running */
+static void reconnect_cancel(struct download_client *dl)
+{
+	k_mutex_lock(&reconnect_lock, K_FOREVER);
+	dl->reconnecting = false;
+	k_mutex_unlock(&reconnect_lock);
+}
+
+static int64_t session_deadline(void)
+{
+	if (CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS == SYS_FOREVER_MS) {
+		return 0;
 	}
 
-	return err;
+	return k_uptime_get() + CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS;
 }
 
-int socket_send(const struct download_client *client, size_t len)
+/* Request the next fragment, if necessary (HTTPS), or the current one
+ * again when the connection was re-established.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int request_next(struct download_client *dl, bool resend)
 {
-	int sent;
-	size_t off = 0;
+	int rc;
 
-	while (len) {
-		sent = send(client->fd, client->buf + off, len, 0);
-		if (sent <= 0) {
-			return -errno;
-		}
+	dl->offset = 0;
+	if (dl->proto == IPPROTO_TCP && !resend) {
+		return 0;
+	}
 
-		off += sent;
-		len -= sent;
+	dl->http.has_header = false;
+
+	rc = request_send(dl);
+	if (rc == 0) {
+		return 0;
+	}
+
+	rc = error_evt_send(dl, ECONNRESET);
+	if (rc) {
+		return rc;
 	}
 
+	/* The request is sent again once connected */
+	reconnect_start(dl);
+
 	return 0;
 }
 
-static int request_send(struct download_client *dl)
+/* Send the rest of the request now that the socket is writable.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int request_flush(struct download_client *dl)
 {
-	switch (dl->proto) {
-		case IPPROTO_TCP:
-		case IPPROTO_TLS_1_2: {
-			return http_get_request_send(dl);
-		}
-		case IPPROTO_UDP:
-		case IPPROTO_DTLS_1_2:
-			break;
+	int rc;
+
+	if (http_request_flush(dl) == 0) {
+		request_sent_mark(dl);
+		return 0;
 	}
 
+	rc = error_evt_send(dl, ECONNRESET);
+	if (rc) {
+		return rc;
+	}
+
+	reconnect_start(dl);
+
 	return 0;
 }
 
-static int fragment_evt_send(const struct download_client *client)
+/* The reconnect is done, resend the request or give up.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int reconnect_finish(struct download_client *dl)
 {
-	__ASSERT(client->offset <= CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-		 "Buffer overflow!");
+	dl->reconnecting = false;
 
-	const struct download_client_evt evt = {
-		.id = DOWNLOAD_CLIENT_EVT_FRAGMENT,
-		.fragment = {
-			.buf = client->buf,
-			.len = client->offset,
-		}
-	};
+	if (dl->reconnect_err) {
+		error_evt_send(dl, EHOSTDOWN);
+		return 1;
+	}
 
-	return client->callback(&evt);
+	return request_next(dl, true);
 }
 
-static int error_evt_send(const struct download_client *dl, int error)
+/* Over HTTP in sink mode, request the next file of the sequence as soon
+ * as the response for the current one begins, so that the server goes
+ * on with it without waiting for a round trip.
+ */
+static void request_ahead(struct download_client *dl)
 {
-	/* Error will be sent as negative. */
-	__ASSERT_NO_MSG(error > 0);
+	if (dl->next_requested || dl->http.connection_close ||
+	    dl->http.request_pending || files_left(dl) == 0) {
+		return;
+	}
 
-	const struct download_client_evt evt = {
-		.id = DOWNLOAD_CLIENT_EVT_ERROR,
-		.error = -error
-	};
+	url_parse_file(dl->files[dl->file_index + 1], dl->url.path,
+		       sizeof(dl->url.path));
+	http_request_init(dl);
 
-	return dl->callback(&evt);
+	if (http_get_request_send(dl, 0)) {
+		/* Requested again once the current file is complete */
+		LOG_WRN("Failed to request the next file ahead");
+		url_parse_file(dl->file, dl->url.path, sizeof(dl->url.path));
+		http_request_init(dl);
+		return;
+	}
+
+	dl->next_requested = true;
 }
 
-static int reconnect(struct download_client *dl)
+/* Move on to the next file of the sequence.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int file_next(struct download_client *dl)
 {
-	int err;
+	int rc;
+	size_t leftover;
+
+	dl->file_index++;
+	dl->file = dl->files[dl->file_index];
+	dl->file_size = 0;
+	dl->progress = 0;
+	dl->sink_pending = 0;
+	dl->http.has_header = false;
+
+	LOG_INF("Downloading: %s [file %u of %u]", log_strdup(dl->file),
+		dl->file_index + 1, dl->files_count);
+
+	if (dl->next_requested) {
+		/* The response may have begun with the last recv() */
+		dl->next_requested = false;
+		leftover = dl->offset;
+		dl->offset = 0;
+		return leftover ? download_process(dl, leftover) : 0;
+	}
 
-	LOG_INF("Reconnecting..");
-	err = download_client_disconnect(dl);
-	if (err) {
-		return err;
+	/* Checked when the sequence was started */
+	url_parse_file(dl->file, dl->url.path, sizeof(dl->url.path));
+	http_request_init(dl);
+
+	if (dl->http.connection_close) {
+		dl->http.connection_close = false;
+		/* The file is requested once connected */
+		reconnect_start(dl);
+		return 0;
 	}
 
-	err = download_client_connect(dl, dl->host, &dl->config);
-	if (err) {
-		return err;
+	return request_next(dl, true);
+}
+
+/* The current file is complete.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int file_done(struct download_client *dl)
+{
+	if (done_evt_send(dl) || files_left(dl) == 0) {
+		return 1;
 	}
 
-	return 0;
+	return file_next(dl);
 }
 
-void download_thread(void *client, void *a, void *b)
+/* Receive what the socket has ready and process it.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int download_recv(struct download_client *dl)
 {
 	int rc = 0;
-	size_t len;
-	struct download_client *const dl = client;
-
-restart_and_suspend:
-	k_thread_suspend(dl->tid);
+	ssize_t len;
 
-	while (true) {
-		__ASSERT(dl->offset < sizeof(dl->buf), "Buffer overflow");
+	__ASSERT(dl->offset < CONFIG_DOWNLOAD_CLIENT_BUF_SIZE, "Buffer overflow");
 
-		if (sizeof(dl->buf) - dl->offset == 0) {
-			LOG_ERR("Could not fit HTTP header from server (> %d)",
-				sizeof(dl->buf));
-			error_evt_send(dl, E2BIG);
-			break;
-		}
+	if (CONFIG_DOWNLOAD_CLIENT_BUF_SIZE - dl->offset == 0) {
+		LOG_ERR("Could not fit HTTP header from server (> %d)",
+			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE);
+		error_evt_send(dl, E2BIG);
+		return 1;
+	}
 
-		LOG_DBG("Receiving up to %d bytes at %p...",
-			(sizeof(dl->buf) - dl->offset), (dl->buf + dl->offset));
-
-		len = recv(dl->fd, dl->buf + dl->offset,
-			   sizeof(dl->buf) - dl->offset, 0);
-
-		if ((len == 0) || (len == -1)) {
-			/* We just had an unexpected socket error or closure */
-
-			/* If there is a partial data payload in our buffer,
-			 * and it has been accounted in our progress, we have
-			 * to hand it to the application before discarding it.
-			 */
-			if ((dl->offset > 0) && (dl->http.has_header)) {
-				rc = fragment_evt_send(dl);
-				if (rc) {
-					/* Restart and suspend */
-					LOG_INF("Fragment refused, download stopped.");
-					break;
-				}
-			}
+	LOG_DBG("Receiving up to %d bytes at %p...",
+		(CONFIG_DOWNLOAD_CLIENT_BUF_SIZE - dl->offset), (dl->buf + dl->offset));
 
-			if (len == -1) {
-				if (errno == ETIMEDOUT) {
-					LOG_DBG("Socket timeout, resending");
-					goto send_again;
-				}
-				LOG_ERR("Error in recv(), errno %d", errno);
-			}
+	len = recv(dl->fd, dl->buf + dl->offset,
+		   CONFIG_DOWNLOAD_CLIENT_BUF_SIZE - dl->offset, 0);
 
-			if (len == 0) {
-				LOG_WRN("Peer closed connection!");
-			}
+	if ((len == -1) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		/* Nothing to read after all */
+		return 0;
+	}
 
-			/* Notify the application of the error via en event.
-			 * Attempt to reconnect and resume the download
-			 * if the application returns Zero via the event.
-			 */
-			rc = error_evt_send(dl, ECONNRESET);
-			if (rc) {
-				/* Restart and suspend */
-				break;
-			}
+	if ((len == 0) || (len == -1)) {
+		/* We just had an unexpected socket error or closure */
 
-			rc = reconnect(dl);
+		/* If there is a partial data payload in our buffer,
+		 * and it has been accounted in our progress, we have
+		 * to hand it to the application before discarding it.
+		 */
+		if ((dl->offset > 0) && (dl->http.has_header)) {
+			rc = fragment_evt_send(dl);
 			if (rc) {
-				error_evt_send(dl, EHOSTDOWN);
-				break;
+				LOG_INF("Fragment refused, download stopped.");
+				return rc;
 			}
-
-			goto send_again;
 		}
 
-		LOG_DBG("Read %d bytes from socket", len);
-
-		if (dl->proto == IPPROTO_TCP || dl->proto == IPPROTO_TLS_1_2) {
-			rc = http_parse(client, len);
-			if (rc > 0) {
-				/* Wait for more data (fragment/header) */
-				continue;
-			}
-		} 
-
-		if (rc < 0) {
-			/* Something was wrong with the packet
-			 * Restart and suspend
-			 */
-			error_evt_send(dl, EBADMSG);
-			break;
-		}
-
-		if (dl->file_size) {
-			LOG_INF("Downloaded %u/%u bytes (%d%%)",
-				dl->progress, dl->file_size,
-				(dl->progress * 100) / dl->file_size);
+		if (len == -1) {
+			LOG_ERR("Error in recv(), errno %d", errno);
 		} else {
-			LOG_INF("Downloaded %u bytes", dl->progress);
+			LOG_WRN("Peer closed connection!");
 		}
 
-		/* Send fragment to application.
-		 * If the application callback returns non-zero, stop.
+		/* Notify the application of the error via en event.
+		 * Attempt to reconnect and resume the download
+		 * if the application returns Zero via the event.
 		 */
-		rc = fragment_evt_send(dl);
+		rc = error_evt_send(dl, ECONNRESET);
 		if (rc) {
-			/* Restart and suspend */
-			LOG_INF("Fragment refused, download stopped.");
-			break;
+			return rc;
 		}
 
-		if (dl->progress == dl->file_size) {
-			LOG_INF("Download complete");
-			const struct download_client_evt evt = {
-				.id = DOWNLOAD_CLIENT_EVT_DONE,
-			};
-			dl->callback(&evt);
-			/* Restart and suspend */
-			break;
-		}
+		reconnect_start(dl);
 
-		/* Attempt to reconnect if the connection was closed */
-		if (dl->http.connection_close) {
-			dl->http.connection_close = false;
-			reconnect(dl);
+		return 0;
+	}
+
+	LOG_DBG("Read %d bytes from socket", len);
+
+	return download_process(dl, len);
+}
+
+/* Process len bytes just placed in the buffer at the current offset.
+ *
+ * Returns non-zero if the download is over.
+ */
+static int download_process(struct download_client *dl, size_t len)
+{
+	int rc = 0;
+	size_t end = dl->offset + len;
+
+	if (http_sink_active(dl)) {
+		/* Past the header, bytes are only counted */
+		return sink_take(dl, dl->buf + dl->offset, len);
+	}
+
+	if (dl->proto == IPPROTO_TCP || dl->proto == IPPROTO_TLS_1_2) {
+		rc = http_parse(dl, len);
+		if (rc >= 0 && http_sink_active(dl)) {
+			request_ahead(dl);
+			/* Count the payload that came with the header */
+			len = dl->offset;
+			dl->offset = 0;
+			return sink_take(dl, dl->buf + end - len, len);
+		}
+		if (rc > 0) {
+			/* Wait for more data (fragment/header) */
+			return 0;
 		}
+	}
 
-send_again:
-		dl->offset = 0;
-		/* Request next fragment, if necessary (HTTPS) */
-		if (dl->proto != IPPROTO_TCP || len == 0) {
-			dl->http.has_header = false;
+	if (rc < 0) {
+		/* Something was wrong with the packet */
+		error_evt_send(dl, EBADMSG);
+		return 1;
+	}
 
-			rc = request_send(dl);
-			if (rc) {
-				rc = error_evt_send(dl, ECONNRESET);
-				if (rc) {
-					/* Restart and suspend */
-					break;
-				}
-
-				rc = reconnect(dl);
-				if (rc) {
-					error_evt_send(dl, EHOSTDOWN);
-					break;
-				}
-
-				goto send_again;
-			}
+	if (dl->file_size) {
+		LOG_INF("Downloaded %u/%u bytes (%d%%)",
+			dl->progress, dl->file_size,
+			(dl->progress * 100) / dl->file_size);
+	} else {
+		LOG_INF("Downloaded %u bytes", dl->progress);
+	}
+
+	/* Send fragment to application.
+	 * If the application callback returns non-zero, stop.
+	 */
+	rc = fragment_evt_send(dl);
+	if (rc) {
+		LOG_INF("Fragment refused, download stopped.");
+		return rc;
+	}
+
+	if (dl->progress == dl->file_size) {
+		return file_done(dl);
+	}
+
+	/* Attempt to reconnect if the connection was closed */
+	if (dl->http.connection_close) {
+		dl->http.connection_close = false;
+		reconnect_start(dl);
+		return 0;
+	}
+
+	return request_next(dl, false);
+}
+
+/* Events to wait for, none while paused or reconnecting */
+static short session_events(const struct download_client *dl)
+{
+	if (dl->paused || dl->reconnecting) {
+		return 0;
+	}
+
+	return dl->http.request_pending ? (POLLIN | POLLOUT) : POLLIN;
+}
+
+static void download_handler(struct event_loop_session *session, int revents)
+{
+	int rc = 0;
+	struct download_client *const dl =
+		CONTAINER_OF(session, struct download_client, session);
+	bool resumed = dl->resumed;
+
+	dl->resumed = false;
+
+	if (dl->reconnecting) {
+		if (!dl->reconnect_done) {
+			/* Woken early, the reconnect wakes the session again */
+			return;
 		}
+		rc = reconnect_finish(dl);
+	} else if (revents) {
+		if ((revents & POLLOUT) && dl->http.request_pending) {
+			rc = request_flush(dl);
+		}
+		if (!rc && (revents & ~POLLOUT)) {
+			rc = download_recv(dl);
+		}
+	} else if (resumed) {
+		/* Wait for the socket again */
+	} else if (dl->http.request_pending) {
+		LOG_WRN("Request not taken by the socket in time");
+		rc = error_evt_send(dl, ECONNRESET);
+		if (!rc) {
+			reconnect_start(dl);
+		}
+	} else {
+		LOG_DBG("Socket timeout, resending");
+		rc = request_next(dl, false);
+	}
+
+	if (rc) {
+		/* Idle until the download is started again */
+		event_loop_remove(session);
+		return;
 	}
 
-	/* Do not let the thread return, since it can't be restarted */
-	goto restart_and_suspend;
+	session->events = session_events(dl);
+	session->deadline = session->events ? session_deadline() : 0;
 }
 
 int download_client_init(struct download_client *const client,
@@ -533,17 +644,24 @@ int download_client_init(struct download_client *const client,
 		return -EINVAL;
 	}
 
+	/* A client initialized before may still hold a socket and a buffer,
+	 * and its reconnect work may be queued.
+	 */
+	if (client->initialized) {
+		(void)download_client_disconnect(client);
+	} else {
+		k_work_init(&client->reconnect_work, reconnect_work_handler);
+	}
+
+	/* Sockets are serviced by the event loop once a download starts */
+	client->session.fd = -1;
+	client->session.handler = download_handler;
+	client->initialized = true;
+
 	client->fd = -1;
+	client->buf = NULL;
 	client->callback = callback;
-
-	/* The thread is spawned now, but it will suspend itself;
-	 * it is resumed when the download is started via the API.
-	 */
-	client->tid =
-		k_thread_create(&client->thread, client->thread_stack,
-				K_THREAD_STACK_SIZEOF(client->thread_stack),
-				download_thread, client, NULL, NULL,
-				K_LOWEST_APPLICATION_THREAD_PRIO, 0, K_NO_WAIT);
+	throughput_init(&client->throughput, hrtime_now());
 
 	return 0;
 }
@@ -552,7 +670,6 @@ int download_client_connect(struct download_client *client, const char *host,
 			    const struct download_client_cfg *config)
 {
 	int err;
-	struct sockaddr sa;
 
 	if (client == NULL || host == NULL || config == NULL) {
 		return -EINVAL;
@@ -568,15 +685,9 @@ int download_client_connect(struct download_client *client, const char *host,
 		return -E2BIG;
 	}
 
-	/* Attempt IPv6 connection if configured, fallback to IPv4 */
-	if (IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_IPV6)) {
-		err = host_lookup(host, AF_INET6, config->apn, &sa);
-	}
-	if (err || !IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_IPV6)) {
-		err = host_lookup(host, AF_INET, config->apn, &sa);
-	}
-
+	err = url_parse(host, &client->url);
 	if (err) {
+		LOG_ERR("Invalid URL %s, err %d", log_strdup(host), err);
 		return err;
 	}
 
@@ -589,58 +700,74 @@ int download_client_connect(struct download_client *client, const char *host,
 #endif
 	client->host = host;
 
-	err = client_connect(client, host, &sa, &client->fd);
-	if (client->fd < 0) {
-		return err;
-	}
-
-	/* Set socket timeout, if configured */
-	err = socket_timeout_set(client->fd);
-	if (err) {
-		return err;
-	}
-
-	return 0;
+	return client_connect(client);
 }
 
 int download_client_disconnect(struct download_client *const client)
 {
-	int err;
-
-	if (client == NULL || client->fd < 0) {
+	if (client == NULL) {
 		return -EINVAL;
 	}
 
-	err = close(client->fd);
-	if (err) {
-		LOG_ERR("Failed to close socket, errno %d", errno);
-		return -errno;
-	}
+	event_loop_remove(&client->session);
+	reconnect_cancel(client);
 
-	client->fd = -1;
+	/* Hand the buffer back for other sessions to use */
+	transport_buf_release(client->buf);
+	client->buf = NULL;
 
-	return 0;
+	if (client->fd < 0) {
+		return -EINVAL;
+	}
+
+	return socket_close(client);
 }
 
-int download_client_start(struct download_client *client, const char *file,
+static int download_begin(struct download_client *client, const char *file,
 			  size_t from)
 {
 	int err;
 
-	if (client == NULL) {
-		return -EINVAL;
+	if (client->fd < 0) {
+		return -ENOTCONN;
 	}
 
-	if (client->fd < 0) {
+	if (client->http.connection_close) {
+		/* The server closed the connection after the last response */
+		client->http.connection_close = false;
+		(void)socket_close(client);
 		return -ENOTCONN;
 	}
 
+	if (client->buf == NULL) {
+		client->buf = transport_buf_lease();
+		if (client->buf == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	err = url_parse_file(file, client->url.path, sizeof(client->url.path));
+	if (err) {
+		LOG_ERR("Invalid file name %s, err %d", log_strdup(file), err);
+		return err;
+	}
+
 	client->file = file;
 	client->file_size = 0;
 	client->progress = from;
+	client->next_requested = false;
+	client->paused = false;
+	client->resumed = false;
 
 	client->offset = 0;
+	client->sink_pending = 0;
 	client->http.has_header = false;
+	client->http.request_pending = false;
+	transport_timing_reset(&client->timing, TRANSPORT_PHASE_REQUEST_SENT);
+
+	if (client->proto == IPPROTO_TCP || client->proto == IPPROTO_TLS_1_2) {
+		http_request_init(client);
+	}
 
 	err = request_send(client);
 	if (err) {
@@ -650,20 +777,75 @@ int download_client_start(struct download_client *client, const char *file,
 	LOG_INF("Downloading: %s [%u]", log_strdup(client->file),
 		client->progress);
 
-	/* Let the thread run */
-	k_thread_resume(client->tid);
+	/* Let the event loop send the rest and receive the response */
+	client->session.fd = client->fd;
+	client->session.events = session_events(client);
+	client->session.deadline = session_deadline();
 
-	return 0;
+	return event_loop_add(&client->session);
+}
+
+int download_client_start(struct download_client *client, const char *file,
+			  size_t from)
+{
+	if (client == NULL) {
+		return -EINVAL;
+	}
+
+	/* Wait for the handler of the previous download to return */
+	event_loop_remove(&client->session);
+	reconnect_cancel(client);
+
+	client->files = NULL;
+	client->files_count = 1;
+	client->file_index = 0;
+
+	return download_begin(client, file, from);
+}
+
+int download_client_start_sequence(struct download_client *client,
+				   const char *const *files, size_t count)
+{
+	int err;
+
+	if (client == NULL || files == NULL || count == 0) {
+		return -EINVAL;
+	}
+
+	/* Wait for the handler of the previous download to return */
+	event_loop_remove(&client->session);
+	reconnect_cancel(client);
+
+	/* Catch bad names now rather than halfway through */
+	for (size_t i = 1; i < count; i++) {
+		err = url_parse_file(files[i], client->url.path,
+				     sizeof(client->url.path));
+		if (err) {
+			LOG_ERR("Invalid file name %s, err %d",
+				log_strdup(files[i]), err);
+			return err;
+		}
+	}
+
+	client->files = files;
+	client->files_count = count;
+	client->file_index = 0;
+
+	return download_begin(client, files[0], 0);
 }
 
 void download_client_pause(struct download_client *client)
 {
-	k_thread_suspend(client->tid);
+	client->paused = true;
+	event_loop_session_set(&client->session, 0, 0);
 }
 
 void download_client_resume(struct download_client *client)
 {
-	k_thread_resume(client->tid);
+	client->paused = false;
+	client->resumed = true;
+	/* Wake the handler, it picks the events to wait for */
+	event_loop_session_set(&client->session, 0, k_uptime_get());
 }
 
 int download_client_file_size_get(struct download_client *client, size_t *size)
@@ -676,3 +858,36 @@ int download_client_file_size_get(struct download_client *client, size_t *size)
 
 	return 0;
 }
+
+int download_client_handshake_time_get(struct download_client *client,
+				       uint32_t *ms)
+{
+	uint32_t us;
+
+	if (!client || !ms) {
+		return -EINVAL;
+	}
+
+	if (transport_timing_us(&client->timing, TRANSPORT_PHASE_DNS_END,
+				TRANSPORT_PHASE_TLS, &us) &&
+	    transport_timing_us(&client->timing, TRANSPORT_PHASE_DNS_END,
+				TRANSPORT_PHASE_CONNECT, &us)) {
+		return -ENODATA;
+	}
+
+	*ms = us / USEC_PER_MSEC;
+
+	return 0;
+}
+
+int download_client_timing_get(struct download_client *client,
+			       struct transport_timing *timing)
+{
+	if (!client || !timing) {
+		return -EINVAL;
+	}
+
+	*timing = client->timing;
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <logging/log.h>
 #include <sys/__assert.h>
@@ -14,91 +15,352 @@
 
 LOG_MODULE_DECLARE(download_client_speedtest, DOWNLOAD_CLIENT_SPEEDTEST_LOG_LEVEL);
 
-#define HOSTNAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_HOSTNAME_SIZE
-#define FILENAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_FILENAME_SIZE
-
-#define GET_HTTP_TEMPLATE                                                      \
-	"GET /%s HTTP/1.1\r\n"                                                 \
-	"Host: %s\r\n"                                                         \
-	"Range: bytes=%u-\r\n"                                                 \
+/* The GET request is sent as these pieces, in order:
+ *
+ *   "GET /" <path> " HTTP/1.1\r\nHost: " <host> "\r\nRange: bytes="
+ *   <from> "-" <to> <tail>
+ *
+ * Only <from> and <to> change from one fragment to the next.
+ * <to> is left empty over HTTP, where the whole file is requested.
+ */
+enum {
+	REQ_GET,
+	REQ_PATH,
+	REQ_HOST_HEADER,
+	REQ_HOST,
+	REQ_RANGE_HEADER,
+	REQ_RANGE_FROM,
+	REQ_RANGE_DASH,
+	REQ_RANGE_TO,
+	REQ_TAIL,
+	REQ_COUNT,
+};
+
+BUILD_ASSERT(REQ_COUNT == DOWNLOAD_CLIENT_HTTP_REQUEST_IOV,
+	     "Request pieces do not match the client");
+
+#define REQUEST_TAIL                                                           \
+	"\r\n"                                                                 \
 	"Connection: keep-alive\r\n"                                           \
 	"\r\n"
 
-#define GET_HTTPS_TEMPLATE                                                     \
-	"GET /%s HTTP/1.1\r\n"                                                 \
-	"Host: %s\r\n"                                                         \
-	"Range: bytes=%u-%u\r\n"                                               \
-	"Connection: keep-alive\r\n"                                           \
-	"\r\n"
+static void iov_set(struct iovec *iov, const char *str)
+{
+	iov->iov_base = (void *)str;
+	iov->iov_len = strlen(str);
+}
 
-int url_parse_host(const char *url, char *host, size_t len);
-int url_parse_file(const char *url, char *file, size_t len);
-int socket_send(const struct download_client *client, size_t len);
+/* Format v right-aligned in the slot ending at end.
+ * Returns the first digit.
+ */
+static char *uint_format(char *end, uint32_t v)
+{
+	char *p = end;
 
-int http_get_request_send(struct download_client *client)
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+
+	return p;
+}
+
+/* Point a range slot piece at the digits of v */
+static void range_set(struct iovec *iov, char *slot, size_t size, uint32_t v)
+{
+	char *digits = uint_format(slot + size, v);
+
+	iov->iov_base = digits;
+	iov->iov_len = slot + size - digits;
+}
+
+void http_request_init(struct download_client *client)
+{
+	struct iovec *req = client->http.request;
+
+	iov_set(&req[REQ_GET], "GET /");
+	iov_set(&req[REQ_PATH], client->url.path);
+	iov_set(&req[REQ_HOST_HEADER], " HTTP/1.1\r\nHost: ");
+	iov_set(&req[REQ_HOST], client->url.host);
+	iov_set(&req[REQ_RANGE_HEADER], "\r\nRange: bytes=");
+	iov_set(&req[REQ_RANGE_DASH], "-");
+	iov_set(&req[REQ_RANGE_TO], "");
+	iov_set(&req[REQ_TAIL], REQUEST_TAIL);
+}
+
+/* Send what is left of the request being sent, without waiting for
+ * room in the socket. Returns zero when the rest is sent or queued for
+ * the next POLLOUT, a negative error code otherwise.
+ */
+int http_request_flush(struct download_client *client)
 {
 	int err;
-	int len;
+
+	err = transport_sendv(client->fd, client->http.pending, REQ_COUNT);
+	client->http.request_pending = (err == -EAGAIN);
+	if (err && err != -EAGAIN) {
+		LOG_ERR("Failed to send HTTP request, err %d", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/* Request the file in client->url.path, starting at byte from */
+int http_get_request_send(struct download_client *client, size_t from)
+{
 	size_t off;
-	char host[HOSTNAME_SIZE];
-	char file[FILENAME_SIZE];
+	struct iovec *req = client->http.request;
+
+	__ASSERT(!client->http.request_pending, "Request still being sent");
 
 	__ASSERT_NO_MSG(client->host);
 	__ASSERT_NO_MSG(client->file);
 
-	err = url_parse_host(client->host, host, sizeof(host));
-	if (err) {
-		return err;
+	range_set(&req[REQ_RANGE_FROM], client->http.range_from,
+		  sizeof(client->http.range_from), from);
+
+	/* We use range requests only for HTTPS, due to memory limitations.
+	 * When using HTTP, we request the whole resource to minimize
+	 * network usage (only one request/response are sent).
+	 */
+	if (client->proto == IPPROTO_TLS_1_2) {
+		/* Offset of last byte in range (Content-Range) */
+		if (client->config.frag_size_override) {
+			off = from +
+				client->config.frag_size_override - 1;
+		} else {
+			off = from +
+				CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE - 1;
+		}
+
+		if (client->file_size != 0) {
+			/* Don't request bytes past the end of file */
+			off = MIN(off, client->file_size - 1);
+		}
+
+		range_set(&req[REQ_RANGE_TO], client->http.range_to,
+			  sizeof(client->http.range_to), off);
 	}
 
-	err = url_parse_file(client->file, file, sizeof(file));
-	if (err) {
-		return err;
+	if (IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_LOG_HEADERS)) {
+		for (size_t i = 0; i < REQ_COUNT; i++) {
+			LOG_HEXDUMP_DBG(req[i].iov_base, req[i].iov_len,
+					"HTTP request");
+		}
+	}
+
+	/* Sending consumes the pieces, keep the originals for next time */
+	memcpy(client->http.pending, req, sizeof(client->http.pending));
+
+	return http_request_flush(client);
+}
+
+/* States of the chunked transfer-encoding decoder */
+enum chunk_state {
+	CHUNK_SIZE,
+	CHUNK_EXT,
+	CHUNK_SIZE_LF,
+	CHUNK_DATA,
+	CHUNK_DATA_CR,
+	CHUNK_DATA_LF,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LINE,
+	CHUNK_TRAILER_LF,
+	CHUNK_DONE,
+};
+
+static int hex_val(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
 	}
+	return -1;
+}
 
-	/* Offset of last byte in range (Content-Range) */
-	if (client->config.frag_size_override) {
-		off = client->progress + client->config.frag_size_override - 1;
-	} else {
-		off = client->progress +
-			CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE - 1;
+/* Decode chunked transfer-encoding in place.
+ * The decoder is fed one byte at a time where framing is concerned,
+ * so chunk headers may be split across any number of recv() calls.
+ *
+ * Returns the number of payload bytes left at the start of `buf`,
+ * or -1 on error.
+ */
+static int http_chunked_decode(struct download_client *client, char *buf,
+			       size_t len)
+{
+	size_t in = 0;
+	size_t out = 0;
+	size_t n;
+	int v;
+
+	while (in < len) {
+		char c = buf[in];
+
+		switch (client->http.chunk_state) {
+		case CHUNK_SIZE:
+			v = hex_val(c);
+			if (v >= 0) {
+				if (client->http.chunk_left > (SIZE_MAX >> 4)) {
+					LOG_ERR("Chunk size too large");
+					return -1;
+				}
+				client->http.chunk_left =
+					(client->http.chunk_left << 4) | v;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				client->http.chunk_state = CHUNK_EXT;
+			} else if (c == '\r') {
+				client->http.chunk_state = CHUNK_SIZE_LF;
+			} else {
+				LOG_ERR("Malformed chunk size");
+				return -1;
+			}
+			in++;
+			break;
+		case CHUNK_EXT:
+			/* Chunk extensions are ignored */
+			if (c == '\r') {
+				client->http.chunk_state = CHUNK_SIZE_LF;
+			}
+			in++;
+			break;
+		case CHUNK_SIZE_LF:
+			if (c != '\n') {
+				LOG_ERR("Malformed chunk header");
+				return -1;
+			}
+			client->http.chunk_state = client->http.chunk_left ?
+				CHUNK_DATA : CHUNK_TRAILER;
+			in++;
+			break;
+		case CHUNK_DATA:
+			n = MIN(client->http.chunk_left, len - in);
+			if (out != in) {
+				memmove(buf + out, buf + in, n);
+			}
+			in += n;
+			out += n;
+			client->http.chunk_left -= n;
+			if (client->http.chunk_left == 0) {
+				client->http.chunk_state = CHUNK_DATA_CR;
+			}
+			break;
+		case CHUNK_DATA_CR:
+			if (c != '\r') {
+				LOG_ERR("Missing CRLF after chunk data");
+				return -1;
+			}
+			client->http.chunk_state = CHUNK_DATA_LF;
+			in++;
+			break;
+		case CHUNK_DATA_LF:
+			if (c != '\n') {
+				LOG_ERR("Missing CRLF after chunk data");
+				return -1;
+			}
+			client->http.chunk_state = CHUNK_SIZE;
+			in++;
+			break;
+		case CHUNK_TRAILER:
+			/* Either the final CRLF or a trailer field */
+			client->http.chunk_state = (c == '\r') ?
+				CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+			in++;
+			break;
+		case CHUNK_TRAILER_LINE:
+			if (c == '\n') {
+				client->http.chunk_state = CHUNK_TRAILER;
+			}
+			in++;
+			break;
+		case CHUNK_TRAILER_LF:
+			if (c != '\n') {
+				LOG_ERR("Malformed chunked trailer");
+				return -1;
+			}
+			client->http.chunk_state = CHUNK_DONE;
+			in++;
+			break;
+		case CHUNK_DONE:
+			LOG_WRN("Discarding %u bytes past last chunk", len - in);
+			in = len;
+			break;
+		}
 	}
 
-	if (client->file_size != 0) {
-		/* Don't request bytes past the end of file */
-		off = MIN(off, client->file_size);
+	return out;
+}
+
+/* Find the value of a header field in the lowercased header of hdr_len
+ * bytes, with leading whitespace skipped. Returns NULL if the field is
+ * not there.
+ */
+static const char *http_header_value(const char *buf, size_t hdr_len,
+				     const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *end = buf + hdr_len;
+	const char *p = buf;
+
+	while ((p = strstr(p, "\r\n")) != NULL && p < end) {
+		p += strlen("\r\n");
+		if ((size_t)(end - p) > name_len &&
+		    strncmp(p, name, name_len) == 0 && p[name_len] == ':') {
+			p += name_len + 1;
+			while (*p == ' ' || *p == '\t') {
+				p++;
+			}
+			return p;
+		}
 	}
 
-	/* We use range requests only for HTTPS, due to memory limitations.
-	 * When using HTTP, we request the whole resource to minimize
-	 * network usage (only one request/response are sent).
-	 */
-	if (client->proto == IPPROTO_TLS_1_2) {
-		len = snprintf(client->buf,
-			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-			GET_HTTPS_TEMPLATE, file, host, client->progress, off);
-	} else {
-		len = snprintf(client->buf,
-			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-			GET_HTTP_TEMPLATE, file, host, client->progress);
+	return NULL;
+}
+
+/* Whether the transfer-codings in a Transfer-Encoding value end with
+ * chunked, which then frames the body whatever the codings before it.
+ */
+static bool http_te_chunked(const char *value)
+{
+	const char *eol = strstr(value, "\r\n");
+	const char *last;
+
+	if (!eol) {
+		return false;
 	}
 
-	if (len < 0 || len > CONFIG_DOWNLOAD_CLIENT_BUF_SIZE) {
-		LOG_ERR("Cannot create GET request, buffer too small");
-		return -ENOMEM;
+	/* Trim trailing whitespace, then take the last coding */
+	while (eol > value && (eol[-1] == ' ' || eol[-1] == '\t')) {
+		eol--;
+	}
+	last = eol;
+	while (last > value && last[-1] != ',' && last[-1] != ' ' &&
+	       last[-1] != '\t') {
+		last--;
 	}
 
-	if (IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_LOG_HEADERS)) {
-		LOG_HEXDUMP_DBG(client->buf, len, "HTTP request");
+	return (eol - last == strlen("chunked")) &&
+	       (strncmp(last, "chunked", strlen("chunked")) == 0);
+}
+
+/* Whether a Content-Encoding value leaves the body as it is */
+static bool http_ce_identity(const char *value)
+{
+	const char *eol = strstr(value, "\r\n");
+
+	if (!eol) {
+		return false;
 	}
 
-	err = socket_send(client, len);
-	if (err) {
-		LOG_ERR("Failed to send HTTP request, errno %d", errno);
-		return err;
+	while (eol > value && (eol[-1] == ' ' || eol[-1] == '\t')) {
+		eol--;
 	}
 
-	return 0;
+	return (eol - value == strlen("identity")) &&
+	       (strncmp(value, "identity", strlen("identity")) == 0);
 }
 
 /* Returns:
@@ -142,10 +404,29 @@ static int http_header_parse(struct download_client *client, size_t *hdr_len)
 		}
 	}
 
+	p = (char *)http_header_value(client->buf, *hdr_len,
+				      "transfer-encoding");
+	client->http.chunked = p && http_te_chunked(p);
+	if (client->http.chunked) {
+		LOG_DBG("Chunked transfer-encoding");
+		client->http.chunk_state = CHUNK_SIZE;
+		client->http.chunk_left = 0;
+	}
+
+	/* Compression is not asked for, an encoded body is passed on as is */
+	p = (char *)http_header_value(client->buf, *hdr_len,
+				      "content-encoding");
+	if (p && !http_ce_identity(p)) {
+		LOG_WRN("Response is content-encoded, delivered undecoded");
+	}
+
 	/* The file size is returned via "Content-Length" in case of HTTP,
 	 * and via "Content-Range" in case of HTTPS with range requests.
+	 * A chunked response over HTTP has no size, the end of the file
+	 * is signaled by the last chunk instead.
 	 */
-	if (client->file_size == 0) {
+	if (client->file_size == 0 &&
+	    !(client->http.chunked && client->proto != IPPROTO_TLS_1_2)) {
 		if (client->proto == IPPROTO_TLS_1_2) {
 			p = strstr(client->buf, "content-range");
 			if (!p) {
@@ -191,6 +472,15 @@ static int http_header_parse(struct download_client *client, size_t *hdr_len)
 	return 0;
 }
 
+/* Whether the payload of the current response is only to be counted */
+bool http_sink_active(const struct download_client *client)
+{
+	return client->config.sink &&
+	       client->proto == IPPROTO_TCP &&
+	       client->http.has_header &&
+	       !client->http.chunked;
+}
+
 /* Returns:
  *  1 if more data is expected
  *  0 if a whole fragment has been received
@@ -215,7 +505,13 @@ int http_parse(struct download_client *client, size_t len)
 			return -1;
 		}
 
-		if (client->offset != hdr_len) {
+		if (http_sink_active(client)) {
+			/* Trailing payload bytes are only counted,
+			 * by the caller.
+			 */
+			client->offset -= hdr_len;
+			return 0;
+		} else if (client->offset != hdr_len) {
 			/* The buffer contains some payload bytes,
 			 * copy them at the beginning of the buffer
 			 * and update the offset.
@@ -234,14 +530,40 @@ int http_parse(struct download_client *client, size_t len)
 		}
 	}
 
-	/* Accumulate overall file progress.
-	 * If the last recv() call read an HTTP header,
+	/* If the last recv() call read an HTTP header,
 	 * `offset` has been moved at the end of any trailing
 	 * payload bytes by http_header_parse(). In this case,
 	 * `offset` is less than `len` and it represents
 	 * the actual payload bytes.
 	 */
-	client->progress += MIN(client->offset, len);
+	len = MIN(client->offset, len);
+
+	if (client->http.chunked) {
+		/* Strip the chunk framing from the bytes just received */
+		rc = http_chunked_decode(client,
+					 client->buf + client->offset - len,
+					 len);
+		if (rc < 0) {
+			return -1;
+		}
+		client->offset -= len - rc;
+		client->progress += rc;
+		throughput_add(&client->throughput, rc);
+
+		if (client->http.chunk_state == CHUNK_DONE) {
+			if (client->file_size == 0) {
+				/* The size is now known */
+				client->file_size = client->progress;
+			}
+			return 0;
+		}
+
+		return (client->offset < CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE);
+	}
+
+	/* Accumulate overall file progress. */
+	client->progress += len;
+	throughput_add(&client->throughput, len);
 
 	/* Have we received a whole fragment or the whole file? */
 	if ((client->offset < CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE) &&
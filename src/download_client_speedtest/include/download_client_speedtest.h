@@ -23,15 +23,21 @@
 #include <zephyr.h>
 #include <zephyr/types.h>
 #include <net/coap.h>
+#include "throughput.h"
+#include "event_loop.h"
+#include "transport.h"
 
 /* Specified here as these are no longer defined in prj.conf */
-#define CONFIG_DOWNLOAD_CLIENT_BUF_SIZE 2048
+#define CONFIG_DOWNLOAD_CLIENT_BUF_SIZE CONFIG_TRANSPORT_BUF_SIZE
 #define CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE 2048
 #define CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE_2048 1
-#define CONFIG_DOWNLOAD_CLIENT_STACK_SIZE 4096
 #define CONFIG_DOWNLOAD_CLIENT_MAX_HOSTNAME_SIZE 64
 #define CONFIG_DOWNLOAD_CLIENT_MAX_FILENAME_SIZE 192
 #define CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS 4000
+#define CONFIG_DOWNLOAD_CLIENT_SINK_NOTIFY_BYTES 8192
+
+/* Number of pieces the HTTP GET request is sent in */
+#define DOWNLOAD_CLIENT_HTTP_REQUEST_IOV 9
 
 #define DOWNLOAD_CLIENT_SPEEDTEST_LOG_LEVEL 1
 
@@ -48,6 +54,9 @@ enum download_client_evt_id {
 	/**
 	 * Event contains a fragment.
 	 * The application may return any non-zero value to stop the download.
+	 *
+	 * In sink mode the fragment buffer is NULL, and its length is the
+	 * number of payload bytes received since the previous event.
 	 */
 	DOWNLOAD_CLIENT_EVT_FRAGMENT,
 	/**
@@ -71,7 +80,12 @@ enum download_client_evt_id {
 	 * network socket as necessary before re-attempting the download.
 	 */
 	DOWNLOAD_CLIENT_EVT_ERROR,
-	/** Download complete. */
+	/**
+	 * Download of a file complete.
+	 *
+	 * In a sequence (@ref download_client_start_sequence) the next file
+	 * follows unless the application returns a non-zero value.
+	 */
 	DOWNLOAD_CLIENT_EVT_DONE,
 };
 
@@ -92,6 +106,11 @@ struct download_client_evt {
 		int error;
 		/** Fragment data. */
 		struct download_fragment fragment;
+		/** Files of the sequence still to download, for
+		 *  @ref DOWNLOAD_CLIENT_EVT_DONE. Zero at the end of
+		 *  the download.
+		 */
+		size_t files_left;
 	};
 };
 
@@ -108,6 +127,23 @@ struct download_client_cfg {
 	 *  values shall be used.
 	 */
 	size_t frag_size_override;
+	/** Enable TLS session caching in the modem, so that reconnects
+	 *  to the same server resume the previous session with an
+	 *  abbreviated handshake instead of a full one.
+	 */
+	bool session_cache;
+	/** Sink mode: payload bytes are only counted, never copied or
+	 *  delivered. The socket is read into the whole buffer each time,
+	 *  and the application is only notified once at least
+	 *  sink_notify_bytes have been received, and at the end of the file.
+	 *  Takes effect over HTTP for responses without transfer- or
+	 *  content-encoding; other downloads are delivered as usual.
+	 */
+	bool sink;
+	/** Notification threshold in sink mode, in bytes.
+	 *  0 indicates that the default value shall be used.
+	 */
+	size_t sink_notify_bytes;
 	/** TLS security tag.
 	 *  Pass -1 to disable TLS.
 	 */
@@ -129,6 +165,11 @@ struct download_client_cfg {
  * If the callback returns a non-zero value, the download stops.
  * To resume the download, use @ref download_client_start().
  *
+ * The callback runs on the event loop thread, other sessions are not
+ * serviced until it returns. It must not block; to hand a fragment to
+ * slow work such as writing flash, copy it, pause the download and
+ * resume it once done.
+ *
  * @param[in] event	The event.
  *
  * @return Zero to continue the download, non-zero otherwise.
@@ -142,8 +183,10 @@ typedef int (*download_client_callback_t)(
 struct download_client {
 	/** Socket descriptor. */
 	int fd;
-	/** Response buffer. */
-	char buf[CONFIG_DOWNLOAD_CLIENT_BUF_SIZE];
+	/** Response buffer, leased from the transport from the start
+	 *  of the first download until disconnecting.
+	 */
+	char *buf;
 	/** Buffer offset. */
 	size_t offset;
 
@@ -151,17 +194,40 @@ struct download_client {
 	size_t file_size;
 	/** Download progress, number of bytes downloaded. */
 	size_t progress;
+	/** Payload bytes counted in sink mode, not yet notified. */
+	size_t sink_pending;
+	/** Payload bytes received over time, HTTP headers and chunk framing
+	 *  left out. Started when the client is initialized, the application
+	 *  may start it again at the beginning of the transfer it measures.
+	 */
+	struct throughput throughput;
 
 	/** Server hosting the file, null-terminated. */
 	const char *host;
 	/** File name, null-terminated. */
 	const char *file;
+	/** Files of the current sequence, NULL for a single file. */
+	const char *const *files;
+	/** Number of files in the current sequence. */
+	size_t files_count;
+	/** Index of the current file in the sequence. */
+	size_t file_index;
+	/** The next file of the sequence has been requested ahead,
+	 *  and url.path already holds its path.
+	 */
+	bool next_requested;
+	/** Host and file, parsed once on connect and start. */
+	struct url url;
 #ifndef USE_SEC_TAG_ARRAY	
 	/** Configuration options. */
 	struct download_client_cfg config;
 #endif	
 	/** Protocol for current download. */
 	int proto;
+	/** Timestamps of the last connection setup and of the
+	 *  current or last download.
+	 */
+	struct transport_timing timing;
 
 	struct  {
 		/** Whether the HTTP header for
@@ -170,6 +236,23 @@ struct download_client {
 		bool has_header;
 		/** The server has closed the connection. */
 		bool connection_close;
+		/** The response uses chunked transfer-encoding. */
+		bool chunked;
+		/** Chunked decoder state. */
+		int chunk_state;
+		/** Bytes left in the current chunk. */
+		size_t chunk_left;
+		/** GET request pieces, set up once per download. */
+		struct iovec request[DOWNLOAD_CLIENT_HTTP_REQUEST_IOV];
+		/** Request being sent, what the socket has not taken yet. */
+		struct iovec pending[DOWNLOAD_CLIENT_HTTP_REQUEST_IOV];
+		/** Part of the request is still to be sent, once the socket
+		 *  is writable.
+		 */
+		bool request_pending;
+		/** Range offset slots, formatted in place for each request. */
+		char range_from[10];
+		char range_to[10];
 	} http;
 
 	struct {
@@ -177,13 +260,23 @@ struct download_client {
 		struct coap_block_context block_ctx;
 	} coap;
 
-	/** Internal thread ID. */
-	k_tid_t tid;
-	/** Internal download thread. */
-	struct k_thread thread;
-	/* Internal thread stack. */
-	K_THREAD_STACK_MEMBER(thread_stack,
-			      CONFIG_DOWNLOAD_CLIENT_STACK_SIZE);
+	/** Event loop session servicing the socket. */
+	struct event_loop_session session;
+	/** Set by the first initialization. */
+	bool initialized;
+	/** The application has paused the download. */
+	bool paused;
+	/** The application has resumed the download, the session
+	 *  is woken to wait for its socket again.
+	 */
+	bool resumed;
+	/** Reconnects run on the event loop work queue. */
+	struct k_work reconnect_work;
+	/** A reconnect is under way, the session idles until it is done. */
+	bool reconnecting;
+	/** The reconnect is done, with this result. */
+	bool reconnect_done;
+	int reconnect_err;
 
 	/** Event handler. */
 	download_client_callback_t callback;
@@ -198,6 +291,10 @@ struct download_client {
 /**
  * @brief Initialize the download client.
  *
+ * A client that was initialized before is disconnected first, its socket
+ * is closed and its buffer returned. The client must be zeroed before it
+ * is first initialized, as static instances are.
+ *
  * @param[in] client	Client instance.
  * @param[in] callback	Callback function.
  *
@@ -234,14 +331,42 @@ int download_client_connect(struct download_client *client, const char *host,
  * @param[in] from	Offset from where to resume the download,
  *			or zero to download from the beginning.
  *
+ * @retval -ENOTCONN if not connected, or if the server closed the
+ *	   connection after the previous response. Connect again with
+ *	   @ref download_client_connect.
  * @retval int Zero on success, a negative error code otherwise.
  */
 int download_client_start(struct download_client *client, const char *file,
 			  size_t from);
 
+/**
+ * @brief Download several files back to back on the same connection.
+ *
+ * Each file is downloaded as with @ref download_client_start, from its
+ * beginning, and ends with a @ref DOWNLOAD_CLIENT_EVT_DONE event. The
+ * next file is requested from the event loop without waiting for the
+ * application. Over HTTP in sink mode it is requested as soon as the
+ * response for the current file begins, so that the server sends the
+ * files without a round trip in between.
+ *
+ * The throughput sampler keeps counting across the files.
+ *
+ * @param[in] client	Client instance.
+ * @param[in] files	Files to download, null-terminated. The array must
+ *			stay valid until the download is over.
+ * @param[in] count	Number of files.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int download_client_start_sequence(struct download_client *client,
+				   const char *const *files, size_t count);
+
 /**
  * @brief Pause the download.
  *
+ * The socket is no longer read until the download is resumed. Can be
+ * called from the event callback.
+ *
  * @param[in] client	Client instance.
  */
 void download_client_pause(struct download_client *client);
@@ -249,6 +374,9 @@ void download_client_pause(struct download_client *client);
 /**
  * @brief Resume the download.
  *
+ * The event loop picks the download up within
+ * @option{CONFIG_EVENT_LOOP_POLL_MS}.
+ *
  * @param[in] client	Client instance.
  */
 void download_client_resume(struct download_client *client);
@@ -265,6 +393,35 @@ void download_client_resume(struct download_client *client);
  */
 int download_client_file_size_get(struct download_client *client, size_t *size);
 
+/**
+ * @brief Retrieve the duration of the last connection setup, in milliseconds.
+ *
+ * For TLS connections this is dominated by the handshake, and can be used
+ * to observe the effect of session resumption across reconnects.
+ *
+ * @param[in]  client	Client instance.
+ * @param[out] ms	Connection setup time.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int download_client_handshake_time_get(struct download_client *client,
+				       uint32_t *ms);
+
+/**
+ * @brief Retrieve the timestamps of the last connection setup and
+ *	  of the current or last download.
+ *
+ * The request is timed from the first GET of the download, the payload
+ * from its first to its last byte received.
+ *
+ * @param[in]  client	Client instance.
+ * @param[out] timing	Timestamps.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int download_client_timing_get(struct download_client *client,
+			       struct transport_timing *timing);
+
 /**
  * @brief Disconnect from the server.
  *
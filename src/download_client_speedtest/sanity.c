@@ -9,9 +9,9 @@
 
 #define HOSTNAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_HOSTNAME_SIZE
 #define FILENAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_FILENAME_SIZE
-#define STACK_SIZE CONFIG_DOWNLOAD_CLIENT_STACK_SIZE
+#define STACK_SIZE CONFIG_EVENT_LOOP_STACK_SIZE
 
-/* Ensure that the stack size is large enough
+/* Ensure that the event loop stack size is large enough
  * to accommodate for host and file names
  */
 
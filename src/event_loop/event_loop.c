@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <string.h>
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <init.h>
+#include <net/socket.h>
+#include "event_loop.h"
+#include <logging/log.h>
+
+LOG_MODULE_REGISTER(event_loop, EVENT_LOOP_LOG_LEVEL);
+
+#define MAX_SESSIONS CONFIG_EVENT_LOOP_MAX_SESSIONS
+
+static struct event_loop_session *sessions[MAX_SESSIONS];
+
+/* Held while the session list is inspected and while handlers run.
+ * Recursive, so that handlers can modify sessions.
+ */
+static K_MUTEX_DEFINE(lock);
+/* Wakes the loop when the first session is added */
+static K_SEM_DEFINE(wake, 0, 1);
+
+/* Blocking work of the sessions */
+static struct k_work_q work_q;
+static K_THREAD_STACK_DEFINE(work_stack, CONFIG_EVENT_LOOP_WORK_STACK_SIZE);
+
+int event_loop_add(struct event_loop_session *session)
+{
+	int err = -ENOMEM;
+
+	k_mutex_lock(&lock, K_FOREVER);
+	if (session->registered) {
+		k_mutex_unlock(&lock);
+		return 0;
+	}
+	for (size_t i = 0; i < MAX_SESSIONS; i++) {
+		if (sessions[i] == NULL) {
+			sessions[i] = session;
+			session->registered = true;
+			err = 0;
+			break;
+		}
+	}
+	k_mutex_unlock(&lock);
+
+	if (err) {
+		LOG_ERR("No free event loop slot");
+		return err;
+	}
+
+	k_sem_give(&wake);
+
+	return 0;
+}
+
+void event_loop_remove(struct event_loop_session *session)
+{
+	k_mutex_lock(&lock, K_FOREVER);
+	for (size_t i = 0; i < MAX_SESSIONS; i++) {
+		if (sessions[i] == session) {
+			sessions[i] = NULL;
+		}
+	}
+	session->registered = false;
+	k_mutex_unlock(&lock);
+}
+
+void event_loop_session_set(struct event_loop_session *session, short events,
+			    int64_t deadline)
+{
+	k_mutex_lock(&lock, K_FOREVER);
+	session->events = events;
+	session->deadline = deadline;
+	k_mutex_unlock(&lock);
+}
+
+void event_loop_work_submit(struct k_work *work)
+{
+	k_work_submit_to_queue(&work_q, work);
+}
+
+void event_loop_delayed_work_submit(struct k_delayed_work *work,
+				    k_timeout_t delay)
+{
+	(void)k_delayed_work_submit_to_queue(&work_q, work, delay);
+}
+
+static void event_loop_thread(void)
+{
+	int rc;
+	int nfds;
+	int timeout;
+	size_t active;
+	int64_t now;
+	struct pollfd fds[MAX_SESSIONS];
+	struct event_loop_session *polled[MAX_SESSIONS];
+	struct event_loop_session *snapshot[MAX_SESSIONS];
+
+	while (true) {
+		nfds = 0;
+		active = 0;
+		timeout = CONFIG_EVENT_LOOP_POLL_MS;
+		now = k_uptime_get();
+
+		k_mutex_lock(&lock, K_FOREVER);
+		for (size_t i = 0; i < MAX_SESSIONS; i++) {
+			struct event_loop_session *s = sessions[i];
+
+			if (s == NULL) {
+				continue;
+			}
+			active++;
+			if (s->deadline) {
+				timeout = MIN(timeout,
+					      (int)MAX(s->deadline - now, 0));
+			}
+			if (s->events) {
+				fds[nfds].fd = s->fd;
+				fds[nfds].events = s->events;
+				fds[nfds].revents = 0;
+				polled[nfds] = s;
+				nfds++;
+			}
+		}
+		k_mutex_unlock(&lock);
+
+		if (active == 0) {
+			k_sem_take(&wake, K_FOREVER);
+			continue;
+		}
+
+		if (nfds) {
+			rc = poll(fds, nfds, timeout);
+			if (rc < 0) {
+				LOG_ERR("poll() failed, err %d", errno);
+				k_sleep(K_MSEC(CONFIG_EVENT_LOOP_POLL_MS));
+				continue;
+			}
+		} else {
+			/* All sessions paused or waiting for a deadline */
+			k_sleep(K_MSEC(timeout));
+		}
+
+		k_mutex_lock(&lock, K_FOREVER);
+
+		for (int i = 0; i < nfds; i++) {
+			struct event_loop_session *s = polled[i];
+
+			/* Skip sessions changed by an earlier handler */
+			if (!fds[i].revents || !s->registered ||
+			    s->fd != fds[i].fd || !s->events) {
+				continue;
+			}
+			s->deadline = 0;
+			s->handler(s, fds[i].revents);
+		}
+
+		memcpy(snapshot, sessions, sizeof(snapshot));
+		now = k_uptime_get();
+		for (size_t i = 0; i < MAX_SESSIONS; i++) {
+			struct event_loop_session *s = snapshot[i];
+
+			if (s == NULL || !s->registered || !s->deadline ||
+			    s->deadline > now) {
+				continue;
+			}
+			s->deadline = 0;
+			s->handler(s, 0);
+		}
+
+		k_mutex_unlock(&lock);
+	}
+}
+
+K_THREAD_DEFINE(event_loop_tid, CONFIG_EVENT_LOOP_STACK_SIZE,
+		event_loop_thread, NULL, NULL, NULL,
+		K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+
+static int event_loop_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	k_work_q_start(&work_q, work_stack, K_THREAD_STACK_SIZEOF(work_stack),
+		       K_LOWEST_APPLICATION_THREAD_PRIO);
+
+	return 0;
+}
+
+SYS_INIT(event_loop_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
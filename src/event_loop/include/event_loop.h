@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file event_loop.h
+ *
+ * @defgroup event_loop Socket event loop
+ * @{
+ * @brief Single thread driving the sockets of all client sessions.
+ *
+ * @details Sessions register a non-blocking socket with the events they
+ * wait for, and an optional deadline. One thread poll()s all registered
+ * sockets and calls the session handler when its socket is ready or its
+ * deadline has passed. Handlers run on the event loop thread, with the
+ * session list locked; they may add, modify and remove sessions,
+ * including their own.
+ *
+ * Handlers must not block, as no other session is serviced meanwhile.
+ * Work that blocks, such as resolving and connecting, is handed to the
+ * event loop work queue with @ref event_loop_work_submit. The work then
+ * wakes its session through its deadline to go on.
+ *
+ * Changes made from other threads are picked up within
+ * @option{CONFIG_EVENT_LOOP_POLL_MS}.
+ */
+
+#ifndef EVENT_LOOP_H__
+#define EVENT_LOOP_H__
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+
+/* Specified here as these are not defined in prj.conf */
+#define CONFIG_EVENT_LOOP_MAX_SESSIONS 6
+#define CONFIG_EVENT_LOOP_STACK_SIZE 4096
+#define CONFIG_EVENT_LOOP_POLL_MS 50
+#define CONFIG_EVENT_LOOP_WORK_STACK_SIZE 4096
+
+#define EVENT_LOOP_LOG_LEVEL 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct event_loop_session;
+
+/**
+ * @brief Session event handler.
+ *
+ * @param[in] session	The session.
+ * @param[in] revents	Events returned by poll(), or zero if the
+ *			deadline of the session has passed.
+ */
+typedef void (*event_loop_handler_t)(struct event_loop_session *session,
+				     int revents);
+
+/**
+ * @brief Event loop session.
+ */
+struct event_loop_session {
+	/** Socket descriptor. */
+	int fd;
+	/** Events to wait for (POLLIN, POLLOUT), zero to pause the session. */
+	short events;
+	/** Uptime in milliseconds after which the handler is called without
+	 *  events, zero for none. It is cleared before the handler is called.
+	 */
+	int64_t deadline;
+	/** Event handler. */
+	event_loop_handler_t handler;
+	/** Whether the session is registered with the loop. */
+	bool registered;
+};
+
+/**
+ * @brief Register a session with the event loop.
+ *
+ * Registering a session that is already registered has no effect.
+ *
+ * @param[in] session	Session, with fd, events and handler set.
+ *
+ * @retval int Zero on success, -ENOMEM if all slots are in use.
+ */
+int event_loop_add(struct event_loop_session *session);
+
+/**
+ * @brief Unregister a session.
+ *
+ * When called from another thread, this waits for any handler
+ * being run to return, so the session is idle afterwards.
+ *
+ * @param[in] session	Session.
+ */
+void event_loop_remove(struct event_loop_session *session);
+
+/**
+ * @brief Change the events and deadline of a session.
+ *
+ * Use this to update a session from outside its handler, for instance
+ * to pause it by clearing its events and deadline.
+ *
+ * @param[in] session	Session.
+ * @param[in] events	Events to wait for.
+ * @param[in] deadline	Deadline, zero for none.
+ */
+void event_loop_session_set(struct event_loop_session *session, short events,
+			    int64_t deadline);
+
+/**
+ * @brief Run blocking work for a session off the event loop thread.
+ *
+ * The work runs on a work queue of its own, without the session list
+ * locked. The session is left idle meanwhile, with no events and no
+ * deadline, and the work wakes it once done with
+ * @ref event_loop_session_set.
+ *
+ * @param[in] work	Work item.
+ */
+void event_loop_work_submit(struct k_work *work);
+
+/**
+ * @brief Run blocking work off the event loop thread, after a delay.
+ *
+ * As @ref event_loop_work_submit, on the same work queue.
+ *
+ * @param[in] work	Delayed work item.
+ * @param[in] delay	Delay before the work runs.
+ */
+void event_loop_delayed_work_submit(struct k_delayed_work *work,
+				    k_timeout_t delay);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVENT_LOOP_H__ */
+
+/**@} */
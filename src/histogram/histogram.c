@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <string.h>
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include "histogram.h"
+
+#define SUB_BITS CONFIG_HISTOGRAM_SUB_BUCKET_BITS
+#define SUB_MASK ((1U << SUB_BITS) - 1)
+
+/* Values below 2^SUB_BITS get a bucket each. Above, the exponent picks
+ * a group of buckets and the bits below the leading one pick the bucket.
+ */
+static uint32_t bucket_index(uint32_t value)
+{
+	uint32_t e;
+	uint32_t i;
+
+	if (value <= SUB_MASK) {
+		return value;
+	}
+
+	e = 31 - __builtin_clz(value);
+	i = ((e - SUB_BITS + 1) << SUB_BITS) + ((value >> (e - SUB_BITS)) & SUB_MASK);
+
+	return MIN(i, HISTOGRAM_BUCKETS - 1);
+}
+
+static uint32_t bucket_low(uint32_t i)
+{
+	uint32_t e;
+
+	if (i <= SUB_MASK) {
+		return i;
+	}
+
+	e = (i >> SUB_BITS) + SUB_BITS - 1;
+
+	return ((1U << SUB_BITS) | (i & SUB_MASK)) << (e - SUB_BITS);
+}
+
+static uint32_t bucket_width(uint32_t i)
+{
+	if (i <= SUB_MASK) {
+		return 1;
+	}
+
+	return 1U << ((i >> SUB_BITS) - 1);
+}
+
+/* Midpoint of the bucket holding the k-th smallest sample,
+ * clamped to the exact extremes.
+ */
+static uint32_t histogram_kth(const struct histogram *h, uint32_t k)
+{
+	uint32_t seen = 0;
+	uint32_t v;
+
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > k) {
+			v = bucket_low(i) + bucket_width(i) / 2;
+			return MIN(MAX(v, h->min), h->max);
+		}
+	}
+
+	return h->max;
+}
+
+void histogram_init(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void histogram_add(struct histogram *h, uint32_t value)
+{
+	if (h->count == 0) {
+		h->min = value;
+		h->max = value;
+	} else {
+		h->jitter_sum += (value > h->last) ? (value - h->last) :
+						     (h->last - value);
+	}
+
+	h->buckets[bucket_index(value)]++;
+	h->count++;
+	h->min = MIN(h->min, value);
+	h->max = MAX(h->max, value);
+	h->sum += value;
+	h->last = value;
+}
+
+int histogram_summary_get(const struct histogram *h,
+			  struct histogram_summary *summary)
+{
+	uint32_t n;
+
+	if (h == NULL || summary == NULL) {
+		return -EINVAL;
+	}
+
+	if (h->count == 0) {
+		return -ENODATA;
+	}
+
+	n = h->count;
+
+	summary->count = n;
+	summary->min = h->min;
+	summary->median = histogram_kth(h, (n - 1) / 2);
+	/* Nearest-rank 95th percentile */
+	summary->p95 = histogram_kth(h, (n * 95 + 99) / 100 - 1);
+	summary->max = h->max;
+	summary->mean = (uint32_t)(h->sum / n);
+	summary->jitter = (n > 1) ? (uint32_t)(h->jitter_sum / (n - 1)) : 0;
+
+	return 0;
+}
+
+void histogram_print(const struct histogram *h, const char *name,
+		     const char *unit)
+{
+	struct histogram_summary summary;
+
+	if (histogram_summary_get(h, &summary)) {
+		printk("%s: no samples\n", name);
+		return;
+	}
+
+	printk("%s: %u samples, %s min %u, median %u, p95 %u, max %u, mean %u, jitter %u\n",
+	       name, summary.count, unit, summary.min, summary.median,
+	       summary.p95, summary.max, summary.mean, summary.jitter);
+
+	/* Distribution, as lower bound of the bucket: count */
+	printk("%s:", name);
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (h->buckets[i]) {
+			printk(" %u:%u", bucket_low(i), h->buckets[i]);
+		}
+	}
+	printk("\n");
+}
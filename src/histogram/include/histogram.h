@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file histogram.h
+ *
+ * @defgroup histogram Log-bucket histogram
+ * @{
+ * @brief Fixed-memory histogram with logarithmic buckets.
+ *
+ * @details Every power of two is split into
+ * 2^CONFIG_HISTOGRAM_SUB_BUCKET_BITS buckets, so percentiles are
+ * reported within 1/2^(CONFIG_HISTOGRAM_SUB_BUCKET_BITS + 1) of the
+ * true value whatever the magnitude, in memory that does not grow
+ * with the number of samples. Minimum and maximum are exact.
+ *
+ * Jitter is the mean absolute difference between consecutive samples,
+ * so the histogram expects samples in the order they were taken.
+ */
+
+#ifndef HISTOGRAM_H__
+#define HISTOGRAM_H__
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+
+/* Specified here as these are not defined in prj.conf */
+#define CONFIG_HISTOGRAM_SUB_BUCKET_BITS 3
+/* Samples of 2^CONFIG_HISTOGRAM_OCTAVES and above share the last bucket */
+#define CONFIG_HISTOGRAM_OCTAVES 26
+
+#define HISTOGRAM_BUCKETS \
+	((CONFIG_HISTOGRAM_OCTAVES - CONFIG_HISTOGRAM_SUB_BUCKET_BITS + 1) << \
+	 CONFIG_HISTOGRAM_SUB_BUCKET_BITS)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Histogram.
+ */
+struct histogram {
+	/** Number of samples per bucket. */
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+	/** Number of samples. */
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	/** Sum of the samples, for the mean. */
+	uint64_t sum;
+	/** Last sample, for the jitter. */
+	uint32_t last;
+	/** Sum of the differences between consecutive samples. */
+	uint64_t jitter_sum;
+};
+
+/**
+ * @brief Histogram summary.
+ *
+ * Values are in the unit of the samples.
+ */
+struct histogram_summary {
+	/** Number of samples summarized. */
+	uint32_t count;
+	uint32_t min;
+	uint32_t median;
+	uint32_t p95;
+	uint32_t max;
+	uint32_t mean;
+	/** Mean absolute difference between consecutive samples. */
+	uint32_t jitter;
+};
+
+/**
+ * @brief Reset a histogram.
+ *
+ * @param[in] h	Histogram.
+ */
+void histogram_init(struct histogram *h);
+
+/**
+ * @brief Add a sample.
+ *
+ * @param[in] h		Histogram.
+ * @param[in] value	Sample.
+ */
+void histogram_add(struct histogram *h, uint32_t value);
+
+/**
+ * @brief Summarize the samples.
+ *
+ * @param[in]  h	Histogram.
+ * @param[out] summary	Summary.
+ *
+ * @retval int Zero on success, -ENODATA if there are no samples.
+ */
+int histogram_summary_get(const struct histogram *h,
+			  struct histogram_summary *summary);
+
+/**
+ * @brief Print the summary and the non-empty buckets.
+ *
+ * @param[in] h		Histogram.
+ * @param[in] name	Label for the printout.
+ * @param[in] unit	Unit of the samples, for the printout.
+ */
+void histogram_print(const struct histogram *h, const char *name,
+		     const char *unit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTOGRAM_H__ */
+
+/**@} */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include "hrtime.h"
+
+#define USEC_PER_S 1000000U
+#define MSEC_PER_S 1000U
+
+#ifdef __ZEPHYR__
+
+#include <zephyr.h>
+#include <spinlock.h>
+
+static struct k_spinlock lock;
+/* Last 32-bit reading and the wraps seen so far */
+static uint32_t last;
+static uint32_t wraps;
+
+uint64_t hrtime_now(void)
+{
+	uint64_t now;
+	uint32_t cycles;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	cycles = k_cycle_get_32();
+	if (cycles < last) {
+		wraps++;
+	}
+	last = cycles;
+	now = ((uint64_t)wraps << 32) | cycles;
+
+	k_spin_unlock(&lock, key);
+
+	return now;
+}
+
+uint32_t hrtime_freq(void)
+{
+	return sys_clock_hw_cycles_per_sec();
+}
+
+#else /* Host */
+
+#include <time.h>
+
+uint64_t hrtime_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+uint32_t hrtime_freq(void)
+{
+	return 1000000000U;
+}
+
+#endif /* __ZEPHYR__ */
+
+/* cycles * mul / freq, without overflowing for long intervals */
+static uint64_t cycles_scale(uint64_t cycles, uint32_t mul)
+{
+	uint32_t freq = hrtime_freq();
+
+	return (cycles / freq) * mul + ((cycles % freq) * mul) / freq;
+}
+
+uint64_t hrtime_to_us(uint64_t cycles)
+{
+	return cycles_scale(cycles, USEC_PER_S);
+}
+
+uint64_t hrtime_to_ms(uint64_t cycles)
+{
+	return cycles_scale(cycles, MSEC_PER_S);
+}
+
+uint64_t hrtime_from_ms(uint32_t ms)
+{
+	return ((uint64_t)ms * hrtime_freq()) / MSEC_PER_S;
+}
+
+uint32_t hrtime_rate(uint64_t bytes, uint64_t cycles)
+{
+	uint64_t rate;
+	uint32_t freq = hrtime_freq();
+
+	if (cycles == 0) {
+		return 0;
+	}
+
+	/* Scaled up front so that short intervals keep their precision */
+	if (bytes > UINT64_MAX / freq) {
+		return UINT32_MAX;
+	}
+	rate = (bytes * freq + cycles / 2) / cycles;
+
+	return (rate > UINT32_MAX) ? UINT32_MAX : (uint32_t)rate;
+}
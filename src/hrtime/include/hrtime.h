@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file hrtime.h
+ *
+ * @defgroup hrtime High-resolution time
+ * @{
+ * @brief 64-bit timestamps at the resolution of the hardware cycle counter.
+ *
+ * @details On target the 32-bit cycle counter is extended to 64 bits,
+ * so intervals do not wrap. On the host, for benches and tests,
+ * timestamps come from the monotonic clock in nanoseconds.
+ *
+ * Conversions and rates are computed in 64-bit integer arithmetic,
+ * with the counter frequency as the fixed-point scale, so short
+ * intervals keep their precision and nothing is truncated through
+ * a float.
+ */
+
+#ifndef HRTIME_H__
+#define HRTIME_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Current time, in counter cycles.
+ *
+ * The counter must be read at least once per wrap of the hardware
+ * counter for the extension to 64 bits to hold.
+ *
+ * @return Cycles since an arbitrary origin.
+ */
+uint64_t hrtime_now(void);
+
+/**
+ * @brief Counter frequency.
+ *
+ * @return Cycles per second.
+ */
+uint32_t hrtime_freq(void);
+
+/**
+ * @brief Convert cycles to microseconds, rounding down.
+ *
+ * @param[in] cycles	Interval, in cycles.
+ *
+ * @return Interval, in microseconds.
+ */
+uint64_t hrtime_to_us(uint64_t cycles);
+
+/**
+ * @brief Convert cycles to milliseconds, rounding down.
+ *
+ * @param[in] cycles	Interval, in cycles.
+ *
+ * @return Interval, in milliseconds.
+ */
+uint64_t hrtime_to_ms(uint64_t cycles);
+
+/**
+ * @brief Convert milliseconds to cycles.
+ *
+ * @param[in] ms	Interval, in milliseconds.
+ *
+ * @return Interval, in cycles.
+ */
+uint64_t hrtime_from_ms(uint32_t ms);
+
+/**
+ * @brief Rate of a transfer, rounded to the nearest byte per second.
+ *
+ * @param[in] bytes	Bytes transferred.
+ * @param[in] cycles	Duration of the transfer, in cycles.
+ *
+ * @return Bytes per second, zero for an empty interval, saturated
+ *	   at UINT32_MAX.
+ */
+uint32_t hrtime_rate(uint64_t bytes, uint64_t cycles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HRTIME_H__ */
+
+/**@} */
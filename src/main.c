@@ -25,11 +25,19 @@
 
 #include "download_client_speedtest.h"
 #include "upload_client.h"
+#include "dns_cache.h"
+#include "event_loop.h"
+#include "transport.h"
+#include "throughput.h"
+#include "histogram.h"
+#include "hrtime.h"
+#include "payload.h"
 #include "xread.h"
 
 #define URL_DL_CONFIG_FILE "https://www.speedtest.net/speedtest-config.php"
 #define URL_DL_SERVERS_FILE "https://www.speedtest.net/speedtest-servers-static.php?"
-#define URL_SPEEDTEST_DOWNLOAD "/speedtest/random3500x3500.jpg"
+#define URL_SPEEDTEST_IMAGES "/speedtest/"
+#define URL_SPEEDTEST_LATENCY "/speedtest/latency.txt"
 #define SAVED_SERVER_FILE "speedtest-servers-static.xml"
 #define TLS_SEC_TAG_ROOT 42
 #define TLS_SEC_TAG_INTERMEDIATE 43
@@ -44,10 +52,59 @@
 
 #define STARTING_OFFSET 0
 
-#define UPLOAD_FILE_SIZE UPLOAD_AND_DOWNLOAD_SIZE
-/* To prevent bandwidth overuse, we limit download size to this limit. */
+/* To prevent bandwidth overuse, each direction of each throughput test
+ * stops at about this many bytes. It stops earlier once the rate is known
+ * within THROUGHPUT_TOLERANCE_PCT, so stable links use less than this.
+ */
 #define DOWNLOAD_LIMIT UPLOAD_AND_DOWNLOAD_SIZE
+#define UPLOAD_LIMIT UPLOAD_AND_DOWNLOAD_SIZE
 #define UPLOAD_AND_DOWNLOAD_SIZE (50 * 1024)
+/* Half-width of the 95 % confidence interval of the mean rate, in
+ * percent, at which a throughput test has seen enough.
+ */
+#define THROUGHPUT_TOLERANCE_PCT 5
+/* Round trips timed by the latency test, on one kept-alive connection */
+#define LATENCY_SAMPLES 20
+/* While a throughput test runs, latency is probed on a second
+ * connection at this interval, to show how much the load adds.
+ */
+#define LATENCY_PROBE_INTERVAL_MS 250
+
+/* Concurrent upload streams */
+#define UPLOAD_STREAMS 4
+/* Each stream posts this much at a time on a keep-alive connection,
+ * and posts again until UPLOAD_TEST_DURATION_MS has passed or another
+ * post would not fit in UPLOAD_LIMIT. All streams get two posts out of it.
+ */
+#define UPLOAD_POST_SIZE (UPLOAD_LIMIT / (2 * UPLOAD_STREAMS))
+#define UPLOAD_TEST_DURATION_MS (10 * MSEC_PER_SEC)
+/* Discarded from the steady-state upload rate, as for the download */
+#define UPLOAD_WARMUP_MS 1000
+
+/* Download and upload at the same time, each direction is reported over
+ * the window in which both were active, after a warm-up. The window also
+ * closes when either direction has used up its byte budget, or when the
+ * rates of both have converged.
+ */
+#define BIDIR_TEST_DURATION_MS (10 * MSEC_PER_SEC)
+#define BIDIR_WARMUP_MS 1000
+
+/* The download test keeps fetching until this much time has passed,
+ * DOWNLOAD_LIMIT has been reached or the rate has converged, whichever
+ * comes first.
+ */
+#define DOWNLOAD_TEST_DURATION_MS (10 * MSEC_PER_SEC)
+/* Request RTT and TCP slow start are excluded from the reported
+ * throughput by discarding the start of the test.
+ */
+#define DOWNLOAD_WARMUP_MS 1000
+/* The download that sizes the test is cut short after this long */
+#define DOWNLOAD_SIZING_MS 2000
+/* The download test fetches this many distinct images back to back on
+ * one connection, the test image and the next larger ones, and starts
+ * the sequence over if it ends first.
+ */
+#define DOWNLOAD_SEQUENCE_FILES 4
 
 #define SW0_NODE	DT_ALIAS(sw0)
 
@@ -92,22 +149,132 @@ static struct gpio_callback button_cb_data;
 
 static struct download_client downloader;
 /* security tags for HTTPS access to speedtest.net to download server list & configuration data. */
+#define SEC_TAG_COUNT 2
 static struct download_client_cfg config_security_dl = { .apn = 0,\
 											 .frag_size_override = 0, \
-											 .sec_tag_array_sz = 2 /* # of items in security tags index list */, \
+											 .session_cache = true, \
+											 .sec_tag_array_sz = SEC_TAG_COUNT /* # of items in security tags index list */, \
 											 .sec_tag_array = {TLS_SEC_TAG_ROOT, TLS_SEC_TAG_INTERMEDIATE} /* Security tags index list */};
 
-static struct upload_client uploader;
+static struct upload_client uploaders[UPLOAD_STREAMS];
+
+struct upload_stream {
+	/** Payload bytes handed to the client. */
+	size_t uploaded;
+	/** Time from the common start until the last request was buffered,
+	 *  in cycles.
+	 */
+	uint64_t buffered;
+	/** Time from the common start until the server responded last,
+	 *  in cycles.
+	 */
+	uint64_t acked;
+	/** Last server response. */
+	struct upload_response response;
+	/** Bytes taken by the socket when the warm-up was over,
+	 *  and when the test time was up.
+	 */
+	uint64_t warmup_time;
+	size_t warmup_bytes;
+	uint64_t end_time;
+	size_t end_bytes;
+	/** The upload has failed. */
+	bool failed;
+	/** Random payload, a fresh fragment at a time. */
+	struct payload payload;
+};
+
+/* Fragments of all upload streams are cut from this ring in order and
+ * filled as they are handed to the clients. A fragment still queued by
+ * one client may be refilled for another before it is sent, which only
+ * swaps random bytes for other random bytes.
+ */
+static uint8_t upload_ring[CONFIG_UPLOAD_CLIENT_CHUNK_MAX];
+static size_t upload_ring_pos;
+
+/* Test images on the speedtest servers, smallest first, with their
+ * approximate sizes. The throughput tests fetch the smallest image that
+ * lasts DOWNLOAD_TEST_DURATION_MS at the rate found by a short download
+ * of the first one, so that slow links do not spend minutes on one
+ * image and fast links leave slow start before the image ends.
+ */
+static const struct {
+	const char *name;
+	size_t size;
+} download_images[] = {
+	{ "random350x350.jpg", 245388 },
+	{ "random500x500.jpg", 505544 },
+	{ "random750x750.jpg", 1118012 },
+	{ "random1000x1000.jpg", 1986284 },
+	{ "random1500x1500.jpg", 4468241 },
+	{ "random2000x2000.jpg", 7907740 },
+	{ "random2500x2500.jpg", 12407926 },
+	{ "random3000x3000.jpg", 17816816 },
+	{ "random3500x3500.jpg", 24262167 },
+};
+/* Image picked for the throughput tests, the largest if sizing fails */
+static size_t download_image = ARRAY_SIZE(download_images) - 1;
+static const char *download_sequence[DOWNLOAD_SEQUENCE_FILES];
+/* Paths of the sequence, without the leading slash the client adds */
+static char download_sequence_files[DOWNLOAD_SEQUENCE_FILES][32];
+
+BUILD_ASSERT(ARRAY_SIZE(download_images) >= DOWNLOAD_SEQUENCE_FILES,
+	     "Too few images for the download sequence");
+
+/* Sizing download. The clock starts on the first fragment, so that
+ * the request round trip does not count.
+ */
+static struct {
+	uint64_t first;
+	uint64_t last;
+	/** Payload received after the first fragment. */
+	size_t bytes;
+	bool failed;
+} sizing;
+
+static struct upload_stream upload_streams[UPLOAD_STREAMS];
+/* Streams that have not finished yet, main is signaled at zero */
+static size_t upload_streams_active;
+/* Bytes the sockets of all streams took together, for the early stop */
+static struct throughput upload_throughput;
+/* Set once the upload test is over, every stream stops at its next POST */
+static bool upload_over;
+/* Bytes of the posts started by all streams, kept within UPLOAD_LIMIT */
+static size_t upload_posted;
+
+/* Bidirectional test. Both directions are sampled together, from the
+ * event loop thread, when the window opens and when it closes.
+ */
+static struct {
+	uint64_t ref_time;
+	/** Download payload received. */
+	size_t dl_bytes;
+	/** Window marks, and the bytes of each direction at the marks. */
+	uint64_t t0;
+	uint64_t t1;
+	size_t dl0;
+	size_t dl1;
+	size_t ul0;
+	size_t ul1;
+	bool dl_done;
+	bool ul_done;
+	bool failed;
+} bidir;
+static char bidir_url[MAX_PATH_LEN];
+static K_SEM_DEFINE(bidir_ul_sem, 0, 1);
+static struct histogram latency_bidir;
 
 /* No HTTPS in upload test to speedtest.net */
 static struct upload_client_cfg config_no_security_ul = { .apn = 0, \
 											 .frag_size_override = 0, \
+											 .throughput = &upload_throughput, \
 											 .sec_tag_array_sz = 0 /* # of items in security tags index list */, \
 											 .sec_tag_array = {0, 0} };
 
-/* No HTTPS in download test from speedtest.net */
+/* No HTTPS in download test from speedtest.net, payload is only counted */
 static struct download_client_cfg config_no_security_dl = { .apn = 0, \
 											 .frag_size_override = 0, \
+											 .sink = true, \
 											 .sec_tag_array_sz = 0 /* # of items in security tags index list */, \
 											 .sec_tag_array = {0, 0} };
 
@@ -135,15 +302,29 @@ static client_data_t client_data = {0};
 static server_data_t closest_server_data = {0};
 
 static bool file_downloaded = false;
+static bool download_failed = false;
 static char server_fname[MAX_PATH_LEN*2];
 
 static struct fs_file_t file;
 
 static int process_downloaded_servers_file(struct fs_file_t *server_file);
 
-static char scratch_buf[CONFIG_DOWNLOAD_CLIENT_BUF_SIZE] = {0};
+/* Leased from the transport buffer pool for the whole run */
+#define SCRATCH_BUF_SIZE CONFIG_TRANSPORT_BUF_SIZE
+static char *scratch_buf;
 static char line_buf[512] = {0};
 
+/* A fragment of the server list, staged in scratch_buf by the download
+ * callback for main to write to flash off the event loop. The download
+ * is paused until it is written, so one fragment is staged at a time.
+ */
+static struct {
+	size_t len;
+	bool done;
+	bool failed;
+} servers_dl;
+static K_MUTEX_DEFINE(servers_dl_lock);
+
 FS_LITTLEFS_DECLARE_DEFAULT_CONFIG(storage);
 static struct fs_mount_t lfs_storage_mnt = {
 	.type = FS_LITTLEFS,
@@ -153,8 +334,27 @@ static struct fs_mount_t lfs_storage_mnt = {
 };
 static char mount_point_name[MAX_PATH_LEN];
 
-static int64_t ref_time_download;
-static int64_t ref_time_upload;
+static uint64_t ref_time_download;
+/* hrtime when the current latency request was started */
+static uint64_t latency_start;
+static struct histogram latency;
+/* Samples lost to an error, the connection is made again for the next */
+static uint32_t latency_lost;
+
+/* Loaded latency probes */
+static struct download_client prober;
+static char probe_url[MAX_PATH_LEN];
+static struct histogram *probe_histogram;
+static uint64_t probe_start;
+static bool probing;
+/* Held by the probe work while it starts a probe, so that the prober is
+ * not disconnected under it.
+ */
+static K_MUTEX_DEFINE(probe_lock);
+static struct k_delayed_work probe_work;
+static struct histogram latency_download;
+static struct histogram latency_upload;
+static uint64_t ref_time_upload;
 
 static const struct device *button = NULL;
 static const struct device *led = NULL;
@@ -298,7 +498,7 @@ static int process_downloaded_config_file(void)
 	p = scratch_buf;
 	lp = line_buf;
 	
-	endp = (scratch_buf + CONFIG_DOWNLOAD_CLIENT_BUF_SIZE);
+	endp = (scratch_buf + SCRATCH_BUF_SIZE);
 	while(p < endp) {
 		i = 0;
 		while ((*p != '\n') && (i < (sizeof(line_buf) - 2)) && (p < endp)) {
@@ -328,6 +528,71 @@ static int process_downloaded_config_file(void)
 	return 1;
 }
 
+static void print_buffer_usage(void)
+{
+	struct transport_buf_stats stats;
+
+	transport_buf_stats_get(&stats);
+	printk("I/O buffer pool : %u of %u slots of %u bytes used at peak\n",
+	       stats.max_used, stats.count, stats.size);
+}
+
+static void print_handshake_time(void)
+{
+	uint32_t handshake_ms;
+
+	if (download_client_handshake_time_get(&downloader, &handshake_ms) == 0) {
+		printk("TLS handshake   : %u ms\n", handshake_ms);
+	}
+}
+
+/* Time spent in each phase of a connection and of the transfer on it */
+static void print_timing(const struct transport_timing *timing,
+			 const char *name)
+{
+	uint32_t us;
+
+	printk("%s phases:\n", name);
+	if (!transport_timing_us(timing, TRANSPORT_PHASE_DNS_START,
+				 TRANSPORT_PHASE_DNS_END, &us)) {
+		printk("  DNS lookup    : %u us\n", us);
+	}
+	if (!transport_timing_us(timing, TRANSPORT_PHASE_DNS_END,
+				 TRANSPORT_PHASE_CONNECT, &us)) {
+		printk("  TCP connect   : %u us\n", us);
+	}
+	if (!transport_timing_us(timing, TRANSPORT_PHASE_DNS_END,
+				 TRANSPORT_PHASE_TLS, &us)) {
+		printk("  TCP + TLS     : %u us\n", us);
+	}
+	if (!transport_timing_us(timing, TRANSPORT_PHASE_REQUEST_SENT,
+				 TRANSPORT_PHASE_FIRST_BYTE, &us)) {
+		printk("  First byte    : %u us after the request\n", us);
+	}
+	if (!transport_timing_us(timing, TRANSPORT_PHASE_FIRST_BYTE,
+				 TRANSPORT_PHASE_LAST_BYTE, &us)) {
+		printk("  Transfer      : %u us\n", us);
+	}
+}
+
+static void print_download_timing(const char *name)
+{
+	struct transport_timing timing;
+
+	if (download_client_timing_get(&downloader, &timing) == 0) {
+		print_timing(&timing, name);
+	}
+}
+
+static void print_upload_timing(struct upload_client *client, const char *name)
+{
+	struct transport_timing timing;
+
+	if (upload_client_timing_get(client, &timing) == 0) {
+		print_timing(&timing, name);
+	}
+}
+
 /* callback for speedtest-config.php downloading & processing. */
 static int callback_for_config_file(const struct download_client_evt *event)
 {
@@ -343,9 +608,9 @@ static int callback_for_config_file(const struct download_client_evt *event)
 	switch (event->id) {
 		case DOWNLOAD_CLIENT_EVT_FRAGMENT:
 			downloaded += event->fragment.len;
-			if (saved_fragment_len < sizeof(scratch_buf)) {
-				int min = MIN(event->fragment.len, (sizeof(scratch_buf) - saved_fragment_len));
-				memcpy(&scratch_buf+saved_fragment_len, event->fragment.buf, min);
+			if (saved_fragment_len < SCRATCH_BUF_SIZE) {
+				int min = MIN(event->fragment.len, (SCRATCH_BUF_SIZE - saved_fragment_len));
+				memcpy(scratch_buf + saved_fragment_len, event->fragment.buf, min);
 				saved_fragment_len += min;
 			}
 			return 0;
@@ -425,8 +690,9 @@ static void calculate_distance(xr_type_t type, const xr_str_t* name, const xr_st
 			first_time = false;
 		}
 		else {
-			if (closest_server_data.distance > server_data_tmp.distance)
+			if (closest_server_data.distance > server_data_tmp.distance) {
 				memcpy(&closest_server_data, &server_data_tmp, sizeof(server_data_t));
+			}
 		}
 
 		//printf("longitude is %0.4lf\n", lon);
@@ -473,7 +739,7 @@ static int process_downloaded_servers_file(struct fs_file_t *server_file)
 
 	p = scratch_buf;
 	lp = line_buf;
-	while((rc = fs_read(server_file, scratch_buf, sizeof(scratch_buf))) > 0) {
+	while((rc = fs_read(server_file, scratch_buf, SCRATCH_BUF_SIZE)) > 0) {
 		endp = (scratch_buf + rc);
 		while(p < endp) {
 			i = 0;
@@ -505,58 +771,65 @@ static int process_downloaded_servers_file(struct fs_file_t *server_file)
 }
 
 /* callback for speedtest-servers-static.php downloading & processing. */
+/* Runs on the event loop, flash is written by main. Decoded bytes are
+ * staged and the download paused until main has written them.
+ */
 static int callback_for_servers_file(const struct download_client_evt *event)
 {
 	static size_t downloaded;
 	static size_t file_size;
-	static bool file_open = false;
-	int rc;
+	bool staged;
 
 	if (downloaded == 0) {
 		download_client_file_size_get(&downloader, &file_size);
 		downloaded += STARTING_OFFSET;
 	}
 
-	/* Create and open file for writing. */
-	if (!file_open) {
-		snprintf(server_fname, sizeof(server_fname), "%s%s", mount_point_name, SAVED_SERVER_FILE);
-		rc = fs_open(&file, server_fname, FS_O_WRITE | FS_O_CREATE);
-		if (rc < 0) {
-			printk("FAIL: open %s: %d\n", server_fname, rc);
-			file_open = false;
-			return -1;
-		}
-		file_open = true;
-	}
-
 	switch (event->id) {
 		case DOWNLOAD_CLIENT_EVT_FRAGMENT: {
 			downloaded += event->fragment.len;
-			rc = fs_write(&file, event->fragment.buf, event->fragment.len);
-			if (rc < 0) {
-				printk("Error writing data to file: %d", rc);				
+			k_mutex_lock(&servers_dl_lock, K_FOREVER);
+			staged = (servers_dl.len == 0 &&
+				  event->fragment.len <= SCRATCH_BUF_SIZE);
+			if (staged) {
+				memcpy(scratch_buf, event->fragment.buf,
+				       event->fragment.len);
+				servers_dl.len = event->fragment.len;
+			} else {
+				servers_dl.failed = true;
+			}
+			k_mutex_unlock(&servers_dl_lock);
+
+			if (!staged) {
+				printk("Server list fragment not staged\n");
+				downloaded = 0;
+				k_sem_give(&main_sem); //signal main to continue
 				return -1; //error
 			}
+
+			download_client_pause(&downloader);
+			k_sem_give(&main_sem); //signal main to write it
 			return(0);
 		}
 		case DOWNLOAD_CLIENT_EVT_DONE: {
-			file_open = false;			
+			printk("Server list     : %d bytes in %u ms\n", downloaded,
+				(uint32_t)hrtime_to_ms(hrtime_now() - ref_time_download));
 			downloaded = 0;
-			rc = fs_sync(&file); //flush buffers to flash
-			if (rc < 0) {
-				printk("Error flushing data to flash: %d", rc);
-				return -1; //error
-			}
-			process_downloaded_servers_file(&file);
-			fs_close(&file);
+			/* Reconnects during the download resume the TLS session */
+			print_handshake_time();
+			k_mutex_lock(&servers_dl_lock, K_FOREVER);
+			servers_dl.done = true;
+			k_mutex_unlock(&servers_dl_lock);
 			k_sem_give(&main_sem); //signal main to continue
 			return 0;
 		}
 		case DOWNLOAD_CLIENT_EVT_ERROR: {
 			printk("Error %d during download of server list\n", event->error);
 			downloaded = 0;
-			/* Delete the file as it is invalid. */
-			(void)fs_unlink(server_fname);
+			k_mutex_lock(&servers_dl_lock, K_FOREVER);
+			servers_dl.failed = true;
+			k_mutex_unlock(&servers_dl_lock);
+			k_sem_give(&main_sem); //signal main to continue
 			/* Stop download */
 			return -1;
 		}
@@ -565,12 +838,350 @@ static int callback_for_servers_file(const struct download_client_evt *event)
 	return 0;
 }
 
+/* Write the server list to the open file a fragment at a time as the
+ * callback stages it, resuming the download once written, until it is
+ * complete.
+ */
+static int servers_file_write(void)
+{
+	int rc;
+	size_t len;
+	bool done;
+	bool failed;
+
+	while (true) {
+		k_sem_take(&main_sem, K_FOREVER);
+
+		k_mutex_lock(&servers_dl_lock, K_FOREVER);
+		len = servers_dl.len;
+		done = servers_dl.done;
+		failed = servers_dl.failed;
+		k_mutex_unlock(&servers_dl_lock);
+
+		if (failed) {
+			return -1;
+		}
+
+		if (len) {
+			rc = fs_write(&file, scratch_buf, len);
+			if (rc < 0) {
+				printk("Error writing data to file: %d\n", rc);
+				return rc;
+			}
+
+			k_mutex_lock(&servers_dl_lock, K_FOREVER);
+			servers_dl.len = 0;
+			k_mutex_unlock(&servers_dl_lock);
+
+			download_client_resume(&downloader);
+		}
+
+		if (done) {
+			break;
+		}
+	}
+
+	rc = fs_sync(&file); //flush buffers to flash
+	if (rc < 0) {
+		printk("Error flushing data to flash: %d\n", rc);
+		return rc;
+	}
+
+	return 0;
+}
+
+/* Whether the mean rate after the warm-up is known well enough */
+static bool throughput_settled(const struct throughput *t, uint32_t warmup_ms)
+{
+	struct throughput_estimate est;
+
+	return (throughput_estimate_get(t, warmup_ms, &est) == 0) &&
+	       throughput_estimate_converged(&est, THROUGHPUT_TOLERANCE_PCT);
+}
+
+static void print_estimate(const struct throughput *t, uint32_t warmup_ms,
+			   const char *name)
+{
+	struct throughput_estimate est;
+
+	if (throughput_estimate_get(t, warmup_ms, &est)) {
+		printk("%s: too short for an estimate\n", name);
+		return;
+	}
+
+	printk("%s: %u +- %u bytes per sec (95%% confidence, %u bins)%s, %u bytes used\n",
+	       name, est.mean, est.ci, est.bins,
+	       throughput_estimate_converged(&est, THROUGHPUT_TOLERANCE_PCT) ?
+	       ", converged" : "", t->total);
+}
+
+static int callback_for_sizing(const struct download_client_evt *event)
+{
+	uint64_t now = hrtime_now();
+
+	switch (event->id) {
+		case DOWNLOAD_CLIENT_EVT_FRAGMENT:
+			if (!sizing.first) {
+				sizing.first = now;
+				return 0;
+			}
+			sizing.bytes += event->fragment.len;
+			sizing.last = now;
+			if ((now - sizing.first >= hrtime_from_ms(DOWNLOAD_SIZING_MS)) ||
+			    (sizing.bytes >= DOWNLOAD_LIMIT)) {
+				k_sem_give(&main_sem); //signal main to continue
+				return 1; //stop
+			}
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_DONE:
+			k_sem_give(&main_sem); //signal main to continue
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_ERROR:
+			printk("Error %d during sizing download\n", event->error);
+			sizing.failed = true;
+			k_sem_give(&main_sem); //signal main to continue
+			/* Stop download */
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Smallest image that lasts the test duration at the given rate. The
+ * byte budget is not part of the pick, it ends the transfer on its own.
+ */
+static size_t download_image_pick(uint32_t rate)
+{
+	uint64_t target;
+
+	target = ((uint64_t)rate * DOWNLOAD_TEST_DURATION_MS) / MSEC_PER_SEC;
+
+	for (size_t i = 0; i < ARRAY_SIZE(download_images) - 1; i++) {
+		if (download_images[i].size >= target) {
+			return i;
+		}
+	}
+
+	return ARRAY_SIZE(download_images) - 1;
+}
+
+/* Download the smallest image for a moment, and pick the image for the
+ * throughput tests from the rate seen.
+ */
+static void download_size(const char *host)
+{
+	int err;
+	uint32_t rate;
+	char url[MAX_PATH_LEN];
+
+	snprintf(url, sizeof(url), "http://%s" URL_SPEEDTEST_IMAGES "%s",
+		 host, download_images[0].name);
+
+	memset(&sizing, 0, sizeof(sizing));
+
+	err = download_client_init(&downloader, callback_for_sizing);
+	if (!err) {
+		err = download_client_connect(&downloader, url, &config_no_security_dl);
+	}
+	if (!err) {
+		err = download_client_start(&downloader, url, STARTING_OFFSET);
+	}
+	if (!err) {
+		k_sem_take(&main_sem, K_FOREVER);
+	}
+	download_client_disconnect(&downloader);
+
+	if (err || sizing.failed || !sizing.bytes) {
+		printk("Sizing failed, using %s\n",
+		       download_images[download_image].name);
+		return;
+	}
+
+	rate = hrtime_rate(sizing.bytes, sizing.last - sizing.first);
+	download_image = download_image_pick(rate);
+	printk("Test image      : %s, for %u bytes per sec over %u ms\n",
+	       download_images[download_image].name, rate,
+	       (uint32_t)hrtime_to_ms(sizing.last - sizing.first));
+}
+
+/* Start the sequence at the picked image, or early enough that the
+ * largest images fill it when the pick is one of them.
+ */
+static void download_sequence_fill(void)
+{
+	size_t first = MIN(download_image,
+			   ARRAY_SIZE(download_images) - DOWNLOAD_SEQUENCE_FILES);
+
+	for (size_t i = 0; i < DOWNLOAD_SEQUENCE_FILES; i++) {
+		snprintf(download_sequence_files[i],
+			 sizeof(download_sequence_files[i]), "%s%s",
+			 &URL_SPEEDTEST_IMAGES[1], download_images[first + i].name);
+		download_sequence[i] = download_sequence_files[i];
+	}
+}
+
+static void report_download_speed(size_t downloaded, size_t warmup_bytes,
+				  uint64_t warmup_time)
+{
+	uint32_t speed;
+	uint64_t now = hrtime_now();
+	uint32_t ms_elapsed = (uint32_t)hrtime_to_ms(now - ref_time_download);
+
+	if (warmup_time && (now > warmup_time) && (downloaded > warmup_bytes)) {
+		speed = hrtime_rate(downloaded - warmup_bytes, now - warmup_time);
+		printk("Download: %u ms @ %u bytes per sec (first %d ms excluded), total %d bytes\n",
+					ms_elapsed, speed, DOWNLOAD_WARMUP_MS, downloaded);
+	} else {
+		/* Test ended during warm-up, nothing better to report */
+		speed = hrtime_rate(downloaded, now - ref_time_download);
+		printk("Download: %u ms @ %u bytes per sec, total %d bytes\n",
+					ms_elapsed, speed, downloaded);
+	}
+}
+
+/* Microseconds from start until now, for latency samples */
+static uint32_t us_since(uint64_t start)
+{
+	return (uint32_t)MIN(hrtime_to_us(hrtime_now() - start), UINT32_MAX);
+}
+
+/* callback for the latency test, each GET of latency.txt is one sample. */
+static int callback_for_latency(const struct download_client_evt *event)
+{
+	switch (event->id) {
+		case DOWNLOAD_CLIENT_EVT_FRAGMENT:
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_DONE:
+			histogram_add(&latency, us_since(latency_start));
+			k_sem_give(&main_sem); //signal main to continue
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_ERROR:
+			printk("Latency sample lost, err %d\n", event->error);
+			latency_lost++;
+			k_sem_give(&main_sem); //signal main to continue
+			/* Stop download */
+			return -1;
+	}
+
+	return 0;
+}
+
+/* callback for the loaded latency probes, the next probe is scheduled
+ * once the last one is answered.
+ */
+static int callback_for_probe(const struct download_client_evt *event)
+{
+	switch (event->id) {
+		case DOWNLOAD_CLIENT_EVT_FRAGMENT:
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_DONE:
+			histogram_add(probe_histogram, us_since(probe_start));
+			if (probing) {
+				event_loop_delayed_work_submit(&probe_work,
+							       K_MSEC(LATENCY_PROBE_INTERVAL_MS));
+			}
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_ERROR:
+			/* Only probing stops, the throughput test goes on */
+			printk("Error %d during latency probe\n", event->error);
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Started from the event loop work queue, the client can't be restarted
+ * from its own callback, and connecting again blocks.
+ */
+static void probe_work_handler(struct k_work *work)
+{
+	int err;
+
+	k_mutex_lock(&probe_lock, K_FOREVER);
+	if (!probing) {
+		k_mutex_unlock(&probe_lock);
+		return;
+	}
+
+	probe_start = hrtime_now();
+	err = download_client_start(&prober, probe_url, STARTING_OFFSET);
+	if (err) {
+		/* The server may have closed the kept-alive connection */
+		download_client_disconnect(&prober);
+		err = download_client_connect(&prober, probe_url, &config_no_security_dl);
+		if (!err) {
+			probe_start = hrtime_now();
+			err = download_client_start(&prober, probe_url, STARTING_OFFSET);
+		}
+	}
+	if (err) {
+		printk("Latency probe stopped, err %d\n", err);
+	}
+	k_mutex_unlock(&probe_lock);
+}
+
+static void latency_probe_begin(struct histogram *h)
+{
+	int err;
+
+	histogram_init(h);
+	probe_histogram = h;
+
+	err = download_client_init(&prober, callback_for_probe);
+	if (!err) {
+		err = download_client_connect(&prober, probe_url, &config_no_security_dl);
+	}
+	if (err) {
+		printk("No latency probes, err %d\n", err);
+		return;
+	}
+
+	k_mutex_lock(&probe_lock, K_FOREVER);
+	probing = true;
+	k_mutex_unlock(&probe_lock);
+	event_loop_delayed_work_submit(&probe_work, K_NO_WAIT);
+}
+
+static void latency_probe_end(void)
+{
+	/* Waits for a probe being started, later ones see probing cleared */
+	k_mutex_lock(&probe_lock, K_FOREVER);
+	probing = false;
+	k_delayed_work_cancel(&probe_work);
+	download_client_disconnect(&prober);
+	k_mutex_unlock(&probe_lock);
+}
+
+static void print_loaded_latency(const struct histogram *loaded, const char *name)
+{
+	struct histogram_summary idle_summary;
+	struct histogram_summary loaded_summary;
+
+	histogram_print(loaded, name, "us");
+
+	if (histogram_summary_get(&latency, &idle_summary) ||
+	    histogram_summary_get(loaded, &loaded_summary)) {
+		return;
+	}
+
+	printk("%s: median RTT %u us idle, %u us loaded, p95 %u us idle, %u us loaded\n",
+	       name, idle_summary.median, loaded_summary.median,
+	       idle_summary.p95, loaded_summary.p95);
+}
+
 static int callback_for_speed_test(const struct download_client_evt *event)
 {
 	static size_t downloaded;
 	static size_t file_size;
-	uint32_t speed;
-	int64_t ms_elapsed;
+	static size_t warmup_bytes;
+	static uint64_t warmup_time;
+	uint64_t now;
 
 	if (downloaded == 0) {
 		download_client_file_size_get(&downloader, &file_size);
@@ -580,13 +1191,23 @@ static int callback_for_speed_test(const struct download_client_evt *event)
 	switch (event->id) {
 		case DOWNLOAD_CLIENT_EVT_FRAGMENT:
 			downloaded += event->fragment.len;
-			
-			if (downloaded > DOWNLOAD_LIMIT) {
-				ms_elapsed = k_uptime_delta(&ref_time_download);
-				speed = ((float)downloaded / ms_elapsed) * MSEC_PER_SEC;
+			now = hrtime_now();
+
+			if (!warmup_time &&
+			    (now - ref_time_download >= hrtime_from_ms(DOWNLOAD_WARMUP_MS))) {
+				/* Steady state starts here */
+				warmup_time = now;
+				warmup_bytes = downloaded;
+			}
 
-				printk("Download: %lld ms @ %d bytes per sec, total %d bytes\n",
-							ms_elapsed, speed, downloaded);				
+			if ((downloaded > DOWNLOAD_LIMIT) ||
+			    (now - ref_time_download >=
+			     hrtime_from_ms(DOWNLOAD_TEST_DURATION_MS)) ||
+			    throughput_settled(&downloader.throughput,
+					       DOWNLOAD_WARMUP_MS)) {
+				report_download_speed(downloaded, warmup_bytes, warmup_time);
+				downloaded = 0;
+				warmup_time = 0;
 				file_downloaded = true;
 				k_sem_give(&main_sem); //signal main to continue
 				return 1; //stop
@@ -595,14 +1216,20 @@ static int callback_for_speed_test(const struct download_client_evt *event)
 			return 0;
 
 		case DOWNLOAD_CLIENT_EVT_DONE:
-			file_downloaded = true;	
+			if (event->files_left) {
+				/* The client goes on with the next one */
+				return 0;
+			}
+			/* Sequence ended before the test did, main starts it again. */
 			k_sem_give(&main_sem); //signal main to continue	
 			return 0;
 
 		case DOWNLOAD_CLIENT_EVT_ERROR:
 			printk("Error %d during download\n", event->error);
 			downloaded = 0;
-			file_downloaded = false;		
+			warmup_time = 0;
+			file_downloaded = false;
+			download_failed = true;
 			k_sem_give(&main_sem); //signal main to continue
 			/* Stop download */
 			return -1;
@@ -611,46 +1238,191 @@ static int callback_for_speed_test(const struct download_client_evt *event)
 	return 0;
 }
 
-static int callback_upload(struct upload_client_evt *event)
+static void upload_stream_finish(void)
+{
+	if (--upload_streams_active == 0) {
+		k_sem_give(&main_sem); //signal main to continue
+	}
+}
+
+/* Sample the bytes taken by the socket at the warm-up and test end marks.
+ * Returns true once the test is over: the time is up, the byte budget
+ * is used up or the rate of all streams together has converged.
+ */
+static bool upload_stream_sample(struct upload_stream *stream,
+				 const struct upload_client *client)
 {
-	static size_t uploaded=0;
-	static size_t count=0;
-	const size_t file_size = UPLOAD_FILE_SIZE;
+	uint64_t now = hrtime_now();
 
-	uint32_t speed;
-	int64_t ms_elapsed;
+	if (!upload_over &&
+	    ((now - ref_time_upload >= hrtime_from_ms(UPLOAD_TEST_DURATION_MS)) ||
+	     (upload_throughput.total >= UPLOAD_LIMIT) ||
+	     throughput_settled(&upload_throughput, UPLOAD_WARMUP_MS))) {
+		upload_over = true;
+	}
+
+	if (!stream->warmup_time &&
+	    (now - ref_time_upload >= hrtime_from_ms(UPLOAD_WARMUP_MS))) {
+		stream->warmup_time = now;
+		stream->warmup_bytes = client->progress;
+	}
+	if (!stream->end_time && upload_over) {
+		stream->end_time = now;
+		stream->end_bytes = client->progress;
+	}
+
+	return stream->end_time != 0;
+}
+
+/* Hand out the next piece of the ring, filled with fresh data so that
+ * nothing on the way can compress or deduplicate it.
+ */
+static void upload_fragment_fill(struct upload_stream *stream,
+				 struct upload_client_evt *event)
+{
+	event->fragment.len = MIN(event->fragment.len,
+				  sizeof(upload_ring) - upload_ring_pos);
+	event->fragment.buf = upload_ring + upload_ring_pos;
+	payload_fill(&stream->payload, event->fragment.buf,
+		     event->fragment.len);
+	upload_ring_pos = (upload_ring_pos + event->fragment.len) %
+			  sizeof(upload_ring);
+}
+
+static int callback_upload(struct upload_client_evt *event)
+{
+	struct upload_stream *stream =
+		&upload_streams[event->client - uploaders];
 
 	switch (event->id) {
 	case UPLOAD_CLIENT_EVT_FRAGMENT:
-		//printk("\n Event: UPLOAD_CLIENT_EVT_FRAGMENT #%d, size = %d bytes\n", (count+1), uploaded);
-		if (uploaded < file_size) {
-			/* Copy send buffer */
-			//event->fragment.len =  CONFIG_DOWNLOAD_CLIENT_BUF_SIZE;
-			event->fragment.len =  1024;
-			event->fragment.buf = scratch_buf;
-			uploaded += event->fragment.len;			
-			++count;
-			return 0;
-		} else {
-			//printk("\r[ %d bytes ] ", uploaded);
-			count = 0;
-			return 1; //Stop uploading
+		upload_stream_sample(stream, event->client);
+		upload_fragment_fill(stream, event);
+		stream->uploaded += event->fragment.len;
+		return 0;
+
+	case UPLOAD_CLIENT_EVT_SENT:
+		/* Only handed to the modem, not necessarily on the wire */
+		stream->buffered = hrtime_now() - ref_time_upload;
+		return 0;
+
+	case UPLOAD_CLIENT_EVT_RESPONSE:
+		/* Keep posting until the test is over */
+		stream->response = event->response;
+		if (upload_posted + UPLOAD_POST_SIZE > UPLOAD_LIMIT) {
+			/* Another post would go over the byte budget */
+			upload_over = true;
 		}
+		if (upload_stream_sample(stream, event->client)) {
+			return 1;
+		}
+		upload_posted += UPLOAD_POST_SIZE;
+		return 0;
 
 	case UPLOAD_CLIENT_EVT_DONE:
-		//printk("\n Event: UPLOAD_CLIENT_EVT_DONE\n");
-		ms_elapsed = k_uptime_delta(&ref_time_upload);
-		speed = ((float)uploaded / ms_elapsed) * MSEC_PER_SEC;
-
-		printk("Upload  : %lld ms @ %d bytes per sec, total %d bytes\n", ms_elapsed, speed, uploaded);
-		//printk("Bye\n");
-		k_sem_give(&main_sem);
-		uploaded = 0;
+		stream->acked = hrtime_now() - ref_time_upload;
+		stream->response = event->response;
+		upload_stream_finish();
 		return 0;
 
 	case UPLOAD_CLIENT_EVT_ERROR:
 		printk("Error %d during upload\n", event->error);
-		uploaded = 0;
+		stream->failed = true;
+		upload_stream_finish();
+		/* Stop upload */
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The window closes when the time is up or either direction has ended */
+static void bidir_sample(void)
+{
+	uint64_t now = hrtime_now();
+
+	if (!bidir.t0 && (now - bidir.ref_time >= hrtime_from_ms(BIDIR_WARMUP_MS))) {
+		bidir.t0 = now;
+		bidir.dl0 = bidir.dl_bytes;
+		bidir.ul0 = uploaders[0].progress;
+	}
+	if (!bidir.t1 && ((now - bidir.ref_time >=
+			   hrtime_from_ms(BIDIR_TEST_DURATION_MS)) ||
+			  (bidir.dl_bytes >= DOWNLOAD_LIMIT) ||
+			  (uploaders[0].progress >= UPLOAD_LIMIT) ||
+			  (throughput_settled(&downloader.throughput, BIDIR_WARMUP_MS) &&
+			   throughput_settled(&upload_throughput, BIDIR_WARMUP_MS)) ||
+			  bidir.dl_done || bidir.ul_done)) {
+		bidir.t1 = now;
+		bidir.dl1 = bidir.dl_bytes;
+		bidir.ul1 = uploaders[0].progress;
+	}
+}
+
+static int callback_for_bidir_download(const struct download_client_evt *event)
+{
+	switch (event->id) {
+		case DOWNLOAD_CLIENT_EVT_FRAGMENT:
+			bidir.dl_bytes += event->fragment.len;
+			bidir_sample();
+			if (bidir.t1) {
+				bidir.dl_done = true;
+				k_sem_give(&main_sem); //signal main to continue
+				return 1; //stop
+			}
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_DONE:
+			/* File ended, main fetches it again unless time is up */
+			bidir_sample();
+			bidir.dl_done = (bidir.t1 != 0);
+			k_sem_give(&main_sem); //signal main to continue
+			return 0;
+
+		case DOWNLOAD_CLIENT_EVT_ERROR:
+			printk("Error %d during bidirectional download\n", event->error);
+			bidir.failed = true;
+			bidir.dl_done = true;
+			bidir_sample();
+			k_sem_give(&main_sem); //signal main to continue
+			/* Stop download */
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Uploads through the first upload stream's payload generator */
+static int callback_for_bidir_upload(struct upload_client_evt *event)
+{
+	struct upload_stream *stream = &upload_streams[0];
+
+	switch (event->id) {
+	case UPLOAD_CLIENT_EVT_FRAGMENT:
+		bidir_sample();
+		upload_fragment_fill(stream, event);
+		return 0;
+
+	case UPLOAD_CLIENT_EVT_SENT:
+		return 0;
+
+	case UPLOAD_CLIENT_EVT_RESPONSE:
+		/* Keep posting while the window is open */
+		bidir_sample();
+		return bidir.t1 ? 1 : 0;
+
+	case UPLOAD_CLIENT_EVT_DONE:
+		bidir.ul_done = true;
+		bidir_sample();
+		k_sem_give(&bidir_ul_sem);
+		return 0;
+
+	case UPLOAD_CLIENT_EVT_ERROR:
+		printk("Error %d during bidirectional upload\n", event->error);
+		bidir.failed = true;
+		bidir.ul_done = true;
+		bidir_sample();
+		k_sem_give(&bidir_ul_sem);
 		/* Stop upload */
 		return -1;
 	}
@@ -658,6 +1430,78 @@ static int callback_upload(struct upload_client_evt *event)
 	return 0;
 }
 
+static void report_bidir_speed(void)
+{
+	if (!bidir.t0 || (bidir.t1 <= bidir.t0)) {
+		printk("Bidir   : ended during warm-up, nothing to report\n");
+		return;
+	}
+
+	printk("Bidir   : both directions active for %u ms (first %d ms excluded)%s\n",
+	       (uint32_t)hrtime_to_ms(bidir.t1 - bidir.t0), BIDIR_WARMUP_MS,
+	       bidir.failed ? ", cut short by an error" : "");
+	printk("Bidir   : download %u bytes per sec, upload %u bytes per sec\n",
+	       hrtime_rate(bidir.dl1 - bidir.dl0, bidir.t1 - bidir.t0),
+	       hrtime_rate(bidir.ul1 - bidir.ul0, bidir.t1 - bidir.t0));
+}
+
+/* Rate between the warm-up and test end marks, zero if not reached */
+static uint32_t upload_steady_rate(const struct upload_stream *stream)
+{
+	if (!stream->warmup_time || (stream->end_time <= stream->warmup_time)) {
+		return 0;
+	}
+
+	return hrtime_rate(stream->end_bytes - stream->warmup_bytes,
+			   stream->end_time - stream->warmup_time);
+}
+
+static void report_upload_speed(void)
+{
+	size_t total = 0;
+	uint64_t buffered = 0;
+	uint64_t acked = 0;
+	uint32_t send_calls = 0;
+	uint32_t steady = 0;
+
+	for (size_t i = 0; i < UPLOAD_STREAMS; i++) {
+		struct upload_stream *stream = &upload_streams[i];
+
+		if (stream->failed) {
+			printk("Upload %u: failed\n", i);
+			continue;
+		}
+		printk("Upload %u: %u bytes in %u posts, steady %u bytes per sec (first %d ms excluded)\n",
+		       i, stream->uploaded, uploaders[i].posts,
+		       upload_steady_rate(stream), UPLOAD_WARMUP_MS);
+		printk("Upload %u: buffered %u ms @ %u, acknowledged %u ms @ %u bytes per sec, HTTP %d, server received %u bytes\n",
+		       i, (uint32_t)hrtime_to_ms(stream->buffered),
+		       hrtime_rate(stream->uploaded, stream->buffered),
+		       (uint32_t)hrtime_to_ms(stream->acked),
+		       hrtime_rate(stream->uploaded, stream->acked),
+		       stream->response.status, stream->response.size);
+		printk("Upload %u: %u send calls, chunk size %u bytes, peak %u\n",
+		       i, uploaders[i].send_calls, uploaders[i].chunk_size,
+		       uploaders[i].chunk_size_peak);
+
+		total += stream->uploaded;
+		buffered = MAX(buffered, stream->buffered);
+		acked = MAX(acked, stream->acked);
+		send_calls += uploaders[i].send_calls;
+		steady += upload_steady_rate(stream);
+	}
+
+	printk("Upload  : %u streams, buffered     %u ms @ %u bytes per sec\n",
+	       UPLOAD_STREAMS, (uint32_t)hrtime_to_ms(buffered),
+	       hrtime_rate(total, buffered));
+	printk("Upload  : %u streams, acknowledged %u ms @ %u bytes per sec, total %u bytes\n",
+	       UPLOAD_STREAMS, (uint32_t)hrtime_to_ms(acked),
+	       hrtime_rate(total, acked), total);
+	printk("Upload  : %u streams, steady %u bytes per sec (first %d ms excluded)\n",
+	       UPLOAD_STREAMS, steady, UPLOAD_WARMUP_MS);
+	printk("Upload  : %u send calls\n", send_calls);
+}
+
 static int init_button_and_led(void)
 {
 	int ret;
@@ -780,6 +1624,13 @@ void main(void)
 
 	printf("Speedtest for Nordic nRF9160 started\n");
 
+	scratch_buf = transport_buf_lease();
+	if (scratch_buf == NULL) {
+		printk("Failed to allocate scratch buffer");
+		return;
+	}
+	memset(scratch_buf, 0, SCRATCH_BUF_SIZE);
+
 	err = bsdlib_init();
 	if (err) {
 		printk("Failed to initialize bsdlib!");
@@ -840,8 +1691,9 @@ void main(void)
 		printk("Failed to connect, err %d", err);
 		return;
 	}
+	print_handshake_time();
 
-	ref_time_download = k_uptime_get();
+	ref_time_download = hrtime_now();
 
 	err = download_client_start(&downloader, URL_DL_CONFIG_FILE, STARTING_OFFSET);
 	if (err) {
@@ -849,6 +1701,7 @@ void main(void)
 		return;
 	}
 	k_sem_take(&main_sem, K_FOREVER);
+	print_download_timing("Client information");
 	download_client_disconnect(&downloader);
 
 	/***********************************************************************/
@@ -874,35 +1727,115 @@ void main(void)
 			printk("Failed to connect, err %d", err);
 			return;
 		}
+		print_handshake_time();
+
+		/* Create and open file for writing. */
+		err = fs_open(&file, server_fname, FS_O_WRITE | FS_O_CREATE);
+		if (err < 0) {
+			printk("FAIL: open %s: %d\n", server_fname, err);
+			return;
+		}
+		servers_dl.len = 0;
+		servers_dl.done = false;
+		servers_dl.failed = false;
 
-		ref_time_download = k_uptime_get();
+		ref_time_download = hrtime_now();
 
 		err = download_client_start(&downloader, URL_DL_SERVERS_FILE, STARTING_OFFSET);
 		if (err) {
 			printk("Failed to start the downloader, err %d", err);
+			fs_close(&file);
+			return;
+		}
+
+		err = servers_file_write();
+		download_client_disconnect(&downloader);
+		if (err) {
+			fs_close(&file);
+			/* Delete the file as it is invalid. */
+			(void)fs_unlink(server_fname);
 			return;
 		}
+		process_downloaded_servers_file(&file);
+		fs_close(&file);
 	} else {
 		printk("Cached file found. Skipping download.\n");
 		process_downloaded_servers_file(&file);
-		k_sem_give(&main_sem); //signal main to continue
 		fs_close(&file);
 	}
 
-	k_sem_take(&main_sem, K_FOREVER);
-
-	download_client_disconnect(&downloader);
-
-	err = url_parse_host(closest_server_data.url, scratch_buf, sizeof(scratch_buf));
+	err = url_parse_host(closest_server_data.url, scratch_buf, SCRATCH_BUF_SIZE);
 	if (err < 0) {
 		printk("Invalid data for nearest server\n");
 		return;
 	}
+	/* Only the server finally selected is worth resolving */
+	dns_cache_prefetch(closest_server_data.url, AF_INET, NULL);
 	
 	printf(TEXT_DIVIDER_EQ);
 	printf("Nearest server  : %s\n", scratch_buf);
 	printf(TEXT_DIVIDER_EQ);
 
+	/***********************************************************************/
+	/* Latency test, before the throughput tests load the link */
+	snprintf(server_fname, sizeof(server_fname), "http://%s%s",
+		 scratch_buf, URL_SPEEDTEST_LATENCY);
+
+	err = download_client_init(&downloader, callback_for_latency);
+	if (err) {
+		printk("Failed to initialize the client, err %d", err);
+		return;
+	}
+
+	err = download_client_connect(&downloader, server_fname, &config_no_security_dl);
+	if (err) {
+		printk("Failed to connect, err %d", err);
+		return;
+	}
+
+	histogram_init(&latency);
+	latency_lost = 0;
+
+	for (int i = 0; i < LATENCY_SAMPLES; i++) {
+		uint32_t lost = latency_lost;
+
+		latency_start = hrtime_now();
+		err = download_client_start(&downloader, server_fname, STARTING_OFFSET);
+		if (err) {
+			/* The server may have closed the connection, the
+			 * handshake is not part of the sample.
+			 */
+			download_client_disconnect(&downloader);
+			err = download_client_connect(&downloader, server_fname, &config_no_security_dl);
+			if (!err) {
+				latency_start = hrtime_now();
+				err = download_client_start(&downloader, server_fname, STARTING_OFFSET);
+			}
+		}
+		if (err) {
+			printk("Failed to start the downloader, err %d", err);
+			break;
+		}
+
+		k_sem_take(&main_sem, K_FOREVER);
+
+		if (latency_lost != lost) {
+			/* Start the next sample on a fresh connection */
+			download_client_disconnect(&downloader);
+		}
+	}
+
+	histogram_print(&latency, "Latency", "us");
+	if (latency_lost) {
+		printk("Latency: %u of %d samples lost\n",
+		       latency_lost, LATENCY_SAMPLES);
+	}
+	download_client_disconnect(&downloader);
+
+	/* The same file is probed while the throughput tests run */
+	strncpy(probe_url, server_fname, sizeof(probe_url) - 1);
+	k_delayed_work_init(&probe_work, probe_work_handler);
+
 	/***********************************************************************/
 	/* Download test */
 	printk("Running speed test..\n");
@@ -920,9 +1853,13 @@ void main(void)
 		return;
 	}
 
+	/* The host starts after the scheme */
+	download_size(server_fname + strlen("http://"));
+
 	p = server_fname;
 	p += strlen(server_fname);
-	strcpy(p, "/speedtest/random3500x3500.jpg");
+	snprintf(p, sizeof(server_fname) - (p - server_fname),
+		 URL_SPEEDTEST_IMAGES "%s", download_images[download_image].name);
 
 	err = download_client_init(&downloader, callback_for_speed_test);
 	if (err) {
@@ -936,24 +1873,48 @@ void main(void)
 		return;
 	}
 
-	ref_time_download = k_uptime_get();
+	latency_probe_begin(&latency_download);
+	ref_time_download = hrtime_now();
+	/* Bins and warm-up share the test start */
+	throughput_init(&downloader.throughput, ref_time_download);
 
-	err = download_client_start(&downloader, server_fname, STARTING_OFFSET);
-	if (err) {
-		printk("Failed to start the downloader, err %d", err);
-		return;
-	}
+	download_sequence_fill();
 
-	k_sem_take(&main_sem, K_FOREVER);
+	/* Fetch the file repeatedly until the test budget is used up */
+	while (!file_downloaded && !download_failed) {
+		err = download_client_start_sequence(&downloader, download_sequence,
+						     ARRAY_SIZE(download_sequence));
+		if (err) {
+			/* The server may have closed the connection after the last file */
+			download_client_disconnect(&downloader);
+			err = download_client_connect(&downloader, server_fname, &config_no_security_dl);
+			if (!err) {
+				err = download_client_start_sequence(&downloader,
+						download_sequence,
+						ARRAY_SIZE(download_sequence));
+			}
+		}
+		if (err) {
+			printk("Failed to start the downloader, err %d", err);
+			latency_probe_end();
+			return;
+		}
+
+		k_sem_take(&main_sem, K_FOREVER);
+	}
+	latency_probe_end();
 	if (!file_downloaded) {
 		printk("Error downloading..is %s down??\n", server_fname);
 		return;
 	}
+	throughput_print(&downloader.throughput, "Download");
+	print_estimate(&downloader.throughput, DOWNLOAD_WARMUP_MS, "Download");
+	print_download_timing("Download (last sequence)");
+	print_loaded_latency(&latency_download, "Latency (download)");
 	download_client_disconnect(&downloader);
 
 	/***********************************************************************/
 	/* Upload test */
-	memset(&scratch_buf, 0x5A, CONFIG_DOWNLOAD_CLIENT_BUF_SIZE);
 	//Compose URL
 	memset(&server_fname[0], 0, sizeof(server_fname));
 	p = server_fname;
@@ -970,29 +1931,128 @@ void main(void)
 	p += strlen(server_fname);
 	strcpy(p, "/speedtest/upload.php");
 
-	err = upload_client_init(&uploader, callback_upload);
-	if (err) {
-		printk("Failed to initialize the client, err %d", err);
+	for (size_t i = 0; i < UPLOAD_STREAMS; i++) {
+		err = upload_client_init(&uploaders[i], callback_upload);
+		if (err) {
+			printk("Failed to initialize the client, err %d", err);
+			return;
+		}
+
+		err = upload_client_connect(&uploaders[i], server_fname, &config_no_security_ul);
+		if (err) {
+			printk("Failed to connect, err %d", err);
+			return;
+		}
+	}
+
+	latency_probe_begin(&latency_upload);
+
+	/* Start all streams together so that they share a time window */
+	memset(upload_streams, 0, sizeof(upload_streams));
+	for (size_t i = 0; i < UPLOAD_STREAMS; i++) {
+		payload_init(&upload_streams[i].payload, k_cycle_get_32() + i);
+	}
+	upload_streams_active = UPLOAD_STREAMS;
+	upload_over = false;
+	upload_posted = UPLOAD_STREAMS * UPLOAD_POST_SIZE;
+	ref_time_upload = hrtime_now();
+	throughput_init(&upload_throughput, ref_time_upload);
+
+	for (size_t i = 0; i < UPLOAD_STREAMS; i++) {
+		err = upload_client_start(&uploaders[i], server_fname, STARTING_OFFSET, UPLOAD_POST_SIZE);
+		if (err) {
+			printk("Failed to start the uploader, err %d", err);
+			latency_probe_end();
+			return;
+		}
+	}
+
+	k_sem_take(&main_sem, K_FOREVER);
+	latency_probe_end();
+	report_upload_speed();
+	print_estimate(&upload_throughput, UPLOAD_WARMUP_MS, "Upload");
+	print_upload_timing(&uploaders[0], "Upload (stream 0)");
+	print_loaded_latency(&latency_upload, "Latency (upload)");
+	printf(TEXT_DIVIDER_EQ);
+	for (size_t i = 0; i < UPLOAD_STREAMS; i++) {
+		upload_client_disconnect(&uploaders[i]);
+	}
+
+	/***********************************************************************/
+	/* Bidirectional test, download and upload at the same time */
+	err = url_parse_host(closest_server_data.url, scratch_buf, SCRATCH_BUF_SIZE);
+	if (err < 0) {
+		printk("Invalid data for nearest server\n");
 		return;
 	}
+	snprintf(bidir_url, sizeof(bidir_url), "http://%s" URL_SPEEDTEST_IMAGES "%s",
+		 scratch_buf, download_images[download_image].name);
 
-	err = upload_client_connect(&uploader, server_fname, &config_no_security_ul);
+	err = download_client_init(&downloader, callback_for_bidir_download);
+	if (!err) {
+		err = download_client_connect(&downloader, bidir_url, &config_no_security_dl);
+	}
+	if (!err) {
+		err = upload_client_init(&uploaders[0], callback_for_bidir_upload);
+	}
+	if (!err) {
+		err = upload_client_connect(&uploaders[0], server_fname, &config_no_security_ul);
+	}
 	if (err) {
-		printk("Failed to connect, err %d", err);
+		printk("Failed to set up the bidirectional test, err %d", err);
 		return;
 	}
 
-	ref_time_upload = k_uptime_get();
-
-	err = upload_client_start(&uploader, server_fname, STARTING_OFFSET, UPLOAD_FILE_SIZE);
+	memset(&bidir, 0, sizeof(bidir));
+	memset(&upload_streams[0], 0, sizeof(upload_streams[0]));
+	payload_init(&upload_streams[0].payload, k_cycle_get_32());
+	k_sem_reset(&bidir_ul_sem);
+	latency_probe_begin(&latency_bidir);
+	bidir.ref_time = hrtime_now();
+	/* Both rates are estimated over the window, for the early stop */
+	throughput_init(&downloader.throughput, bidir.ref_time);
+	throughput_init(&upload_throughput, bidir.ref_time);
+
+	err = upload_client_start(&uploaders[0], server_fname, STARTING_OFFSET, UPLOAD_POST_SIZE);
 	if (err) {
 		printk("Failed to start the uploader, err %d", err);
+		latency_probe_end();
 		return;
 	}
 
-	k_sem_take(&main_sem, K_FOREVER);
+	/* Fetch the file repeatedly until the window closes */
+	while (!bidir.dl_done) {
+		err = download_client_start(&downloader, bidir_url, STARTING_OFFSET);
+		if (err) {
+			/* The server may have closed the connection after the last file */
+			download_client_disconnect(&downloader);
+			err = download_client_connect(&downloader, bidir_url, &config_no_security_dl);
+			if (!err) {
+				err = download_client_start(&downloader, bidir_url, STARTING_OFFSET);
+			}
+		}
+		if (err) {
+			printk("Failed to start the downloader, err %d", err);
+			/* Closes the window for the upload too */
+			bidir.failed = true;
+			bidir.dl_done = true;
+			break;
+		}
+
+		k_sem_take(&main_sem, K_FOREVER);
+	}
+
+	/* The upload finishes the POST it is in */
+	k_sem_take(&bidir_ul_sem, K_FOREVER);
+	latency_probe_end();
+	report_bidir_speed();
+	print_download_timing("Bidirectional download (last file)");
+	print_upload_timing(&uploaders[0], "Bidirectional upload");
+	print_loaded_latency(&latency_bidir, "Latency (bidir)");
 	printf(TEXT_DIVIDER_EQ);
-	upload_client_disconnect(&uploader);
+	download_client_disconnect(&downloader);
+	upload_client_disconnect(&uploaders[0]);
+	print_buffer_usage();
 	/***********************************************************************/
 
 	err = fs_unmount(mp);
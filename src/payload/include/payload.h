@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file payload.h
+ *
+ * @defgroup payload Upload payload generator
+ * @{
+ * @brief Incompressible payload for the upload test.
+ *
+ * @details Fills buffers with the output of a xorshift128 generator.
+ * Constant or repeating payload can be compressed or deduplicated
+ * on the way to the server, which inflates the measured throughput.
+ * The generator only keeps 16 bytes of state, so fresh data can be
+ * produced for every fragment instead of staging a large buffer.
+ *
+ * The generator has no kernel dependencies, so it can be
+ * benchmarked on the host, see test/bench.c.
+ */
+
+#ifndef PAYLOAD_H__
+#define PAYLOAD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Generator state.
+ */
+struct payload {
+	uint32_t x;
+	uint32_t y;
+	uint32_t z;
+	uint32_t w;
+};
+
+/**
+ * @brief Seed the generator.
+ *
+ * Generators seeded differently produce unrelated streams.
+ *
+ * @param[out] p	Generator.
+ * @param[in]  seed	Seed, any value.
+ */
+void payload_init(struct payload *p, uint32_t seed);
+
+/**
+ * @brief Fill a buffer with the next bytes of the stream.
+ *
+ * @param[in,out] p	Generator.
+ * @param[out]    buf	Buffer, any alignment.
+ * @param[in]     len	Number of bytes.
+ */
+void payload_fill(struct payload *p, void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PAYLOAD_H__ */
+
+/**@} */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <string.h>
+#include "payload.h"
+
+/* SplitMix32 finalizer, spreads the seed over the state */
+static uint32_t mix(uint32_t *s)
+{
+	uint32_t z = (*s += 0x9e3779b9);
+
+	z = (z ^ (z >> 16)) * 0x85ebca6b;
+	z = (z ^ (z >> 13)) * 0xc2b2ae35;
+
+	return z ^ (z >> 16);
+}
+
+void payload_init(struct payload *p, uint32_t seed)
+{
+	p->x = mix(&seed);
+	p->y = mix(&seed);
+	p->z = mix(&seed);
+	p->w = mix(&seed);
+
+	/* The all-zero state is a fixed point */
+	if (!(p->x | p->y | p->z | p->w)) {
+		p->w = 1;
+	}
+}
+
+/* Marsaglia, "Xorshift RNGs", 2003 */
+#define XORSHIFT128(x, y, z, w, t)				\
+	do {							\
+		t = x ^ (x << 11);				\
+		x = y;						\
+		y = z;						\
+		z = w;						\
+		w = w ^ (w >> 19) ^ t ^ (t >> 8);		\
+	} while (0)
+
+void payload_fill(struct payload *p, void *buf, size_t len)
+{
+	uint8_t *out = buf;
+	/* Work on a copy, stores through out could alias the state
+	 * and force it to be reloaded for every word.
+	 */
+	uint32_t x = p->x;
+	uint32_t y = p->y;
+	uint32_t z = p->z;
+	uint32_t w = p->w;
+	uint32_t t;
+
+	/* A word at a time, memcpy() copes with any alignment */
+	while (len >= sizeof(w)) {
+		XORSHIFT128(x, y, z, w, t);
+		memcpy(out, &w, sizeof(w));
+		out += sizeof(w);
+		len -= sizeof(w);
+	}
+
+	if (len) {
+		XORSHIFT128(x, y, z, w, t);
+		memcpy(out, &w, len);
+	}
+
+	p->x = x;
+	p->y = y;
+	p->z = z;
+	p->w = w;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/* Host benchmark of the payload generator.
+ *
+ *   cc -O2 -I../include -o bench bench.c ../payload.c -lm
+ *   ./bench [fragment size] [megabytes]
+ *
+ * Prints the generator speed next to memset() of the same buffer,
+ * and the byte entropy of the output, which should be close to 8 bits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "payload.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0ULL
+#endif
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, double s, uint64_t c)
+{
+	printf("%-8s: %8.1f MB/s", name, bytes / s / 1e6);
+	if (c) {
+		printf(", %6.2f bytes/cycle", (double)bytes / c);
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	size_t frag = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1024;
+	size_t total = ((argc > 2) ? strtoul(argv[2], NULL, 0) : 256) << 20;
+	size_t rounds = total / frag;
+	unsigned char *buf = malloc(frag);
+	unsigned long hist[256] = { 0 };
+	struct payload p;
+	double t, entropy = 0;
+	uint64_t c;
+
+	if (buf == NULL || frag == 0) {
+		return 1;
+	}
+
+	payload_init(&p, 1);
+
+	t = now();
+	c = cycles();
+	for (size_t i = 0; i < rounds; i++) {
+		payload_fill(&p, buf, frag);
+		/* Keep the fill from being optimized out */
+		__asm__ volatile("" : : "r"(buf) : "memory");
+	}
+	report("payload", rounds * frag, now() - t, cycles() - c);
+
+	t = now();
+	c = cycles();
+	for (size_t i = 0; i < rounds; i++) {
+		memset(buf, (int)i, frag);
+		__asm__ volatile("" : : "r"(buf) : "memory");
+	}
+	report("memset", rounds * frag, now() - t, cycles() - c);
+
+	for (size_t i = 0; i < (16 << 20) / frag; i++) {
+		payload_fill(&p, buf, frag);
+		for (size_t j = 0; j < frag; j++) {
+			hist[buf[j]]++;
+		}
+	}
+	for (int i = 0; i < 256; i++) {
+		double f = (double)hist[i] / ((16 << 20) / frag * frag);
+
+		entropy -= f ? f * log2(f) : 0;
+	}
+	printf("entropy : %.4f bits per byte\n", entropy);
+
+	free(buf);
+
+	return 0;
+}
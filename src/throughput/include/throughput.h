@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file throughput.h
+ *
+ * @defgroup throughput Throughput sampling
+ * @{
+ * @brief Time-bucketed throughput sampling.
+ *
+ * @details Bytes are accounted into a ring of fixed-length time bins,
+ * so that the throughput over time can be inspected after a transfer,
+ * and summarized with percentiles rather than a single average.
+ * Cellular scheduling stalls show up as empty bins.
+ *
+ * The bins also give an estimate of the mean rate with its 95 %
+ * confidence interval, so that a test can stop as soon as the rate
+ * is known well enough rather than after a fixed amount of data.
+ */
+
+#ifndef THROUGHPUT_H__
+#define THROUGHPUT_H__
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+
+/* Specified here as these are not defined in prj.conf */
+#define CONFIG_THROUGHPUT_BIN_MS 100
+#define CONFIG_THROUGHPUT_BINS 128
+/* Fewer bins than this never make a converged estimate */
+#define CONFIG_THROUGHPUT_ESTIMATE_MIN_BINS 10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief One time bin.
+ */
+struct throughput_bin {
+	/** Start of the bin, in milliseconds since the sampler start. */
+	uint32_t t_ms;
+	/** Bytes accounted during the bin. */
+	uint32_t bytes;
+};
+
+/**
+ * @brief Throughput sampler.
+ */
+struct throughput {
+	/** Ring of bins. */
+	struct throughput_bin bins[CONFIG_THROUGHPUT_BINS];
+	/** Index of the current (newest) bin. */
+	uint32_t head;
+	/** Number of valid bins, including the current one. */
+	uint32_t count;
+	/** Sequence number of the current bin since the sampler start. */
+	uint32_t seq;
+	/** High-resolution time the bins are counted from, in cycles. */
+	uint64_t start;
+	/** Total bytes accounted. */
+	size_t total;
+};
+
+/**
+ * @brief Throughput summary, over complete bins.
+ *
+ * All rates are in bytes per second.
+ */
+struct throughput_summary {
+	/** Number of bins summarized. */
+	uint32_t bins;
+	uint32_t min;
+	uint32_t median;
+	uint32_t p90;
+	uint32_t max;
+	/** Mean over the summarized bins. */
+	uint32_t mean;
+};
+
+/**
+ * @brief Estimate of the mean rate, over complete bins.
+ *
+ * All rates are in bytes per second.
+ */
+struct throughput_estimate {
+	/** Number of bins the estimate is based on. */
+	uint32_t bins;
+	/** Mean over the bins. */
+	uint32_t mean;
+	/** Half-width of the 95 % confidence interval of the mean. */
+	uint32_t ci;
+};
+
+/**
+ * @brief Reset a sampler.
+ *
+ * The first bin begins at start, so that bin times share their
+ * reference with the transfer being measured.
+ *
+ * @param[in] t		Sampler.
+ * @param[in] start	High-resolution time of the start, from
+ *			@ref hrtime_now.
+ */
+void throughput_init(struct throughput *t, uint64_t start);
+
+/**
+ * @brief Account bytes to the bin of the current time.
+ *
+ * Bins in which nothing was accounted are recorded as empty.
+ *
+ * @param[in] t		Sampler.
+ * @param[in] bytes	Number of bytes.
+ */
+void throughput_add(struct throughput *t, size_t bytes);
+
+/**
+ * @brief Summarize the complete bins.
+ *
+ * The current bin is still being filled and is left out.
+ *
+ * @param[in]  t	Sampler.
+ * @param[out] summary	Summary.
+ *
+ * @retval int Zero on success, -ENODATA if there is no complete bin yet.
+ */
+int throughput_summary_get(const struct throughput *t,
+			   struct throughput_summary *summary);
+
+/**
+ * @brief Estimate the mean rate over the complete bins.
+ *
+ * The bins are treated as independent samples, and the current bin
+ * is left out.
+ *
+ * @param[in]  t	Sampler.
+ * @param[in]  skip_ms	Bins starting before this time since the sampler
+ *			start are left out, to skip slow start.
+ * @param[out] est	Estimate.
+ *
+ * @retval int Zero on success, -ENODATA if fewer than two bins are left.
+ */
+int throughput_estimate_get(const struct throughput *t, uint32_t skip_ms,
+			    struct throughput_estimate *est);
+
+/**
+ * @brief Whether an estimate is known well enough.
+ *
+ * @param[in] est		Estimate.
+ * @param[in] tolerance_pct	Largest confidence interval half-width
+ *				accepted, in percent of the mean.
+ *
+ * @return true if the estimate is based on at least
+ *	   @option{CONFIG_THROUGHPUT_ESTIMATE_MIN_BINS} bins and within
+ *	   the tolerance.
+ */
+bool throughput_estimate_converged(const struct throughput_estimate *est,
+				   uint32_t tolerance_pct);
+
+/**
+ * @brief Print the summary and the throughput-over-time curve.
+ *
+ * @param[in] t		Sampler.
+ * @param[in] name	Label for the printout.
+ */
+void throughput_print(const struct throughput *t, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THROUGHPUT_H__ */
+
+/**@} */
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <string.h>
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include "throughput.h"
+#include "hrtime.h"
+
+#define BIN_MS CONFIG_THROUGHPUT_BIN_MS
+#define BINS CONFIG_THROUGHPUT_BINS
+
+/* Number of bins printed per line of the curve */
+#define CURVE_BINS_PER_LINE 10
+
+/* 1.96^2, for a two-sided 95 % confidence interval, scaled by 100 */
+#define Z95_SQ_X100 384
+
+void throughput_init(struct throughput *t, uint64_t start)
+{
+	memset(t, 0, sizeof(*t));
+	t->start = start;
+	t->count = 1;
+}
+
+void throughput_add(struct throughput *t, size_t bytes)
+{
+	uint64_t now = hrtime_now();
+	uint32_t seq;
+
+	seq = (uint32_t)(hrtime_to_ms(now - t->start) / BIN_MS);
+
+	/* After a long stall only the last BINS empty bins matter */
+	if (seq - t->seq > BINS) {
+		t->seq = seq - BINS;
+	}
+
+	/* Open a bin for every interval that has passed */
+	while (t->seq < seq) {
+		t->seq++;
+		t->head = (t->head + 1) % BINS;
+		t->bins[t->head].t_ms = t->seq * BIN_MS;
+		t->bins[t->head].bytes = 0;
+		if (t->count < BINS) {
+			t->count++;
+		}
+	}
+
+	t->bins[t->head].bytes += bytes;
+	t->total += bytes;
+}
+
+/* The i-th complete bin, oldest first */
+static const struct throughput_bin *bin_get(const struct throughput *t,
+					    uint32_t i)
+{
+	uint32_t oldest = (t->head + BINS - (t->count - 1)) % BINS;
+
+	return &t->bins[(oldest + i) % BINS];
+}
+
+/* Bytes of the i-th complete bin, oldest first */
+static uint32_t bin_bytes(const struct throughput *t, uint32_t i)
+{
+	return bin_get(t, i)->bytes;
+}
+
+/* k-th smallest of the n complete bins, without a sorted copy */
+static uint32_t bin_kth(const struct throughput *t, uint32_t n, uint32_t k)
+{
+	uint32_t v = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t less = 0;
+		uint32_t less_eq = 0;
+
+		v = bin_bytes(t, i);
+		for (uint32_t j = 0; j < n; j++) {
+			uint32_t w = bin_bytes(t, j);
+
+			less += (w < v);
+			less_eq += (w <= v);
+		}
+		if (less <= k && k < less_eq) {
+			break;
+		}
+	}
+
+	return v;
+}
+
+static uint32_t bin_rate(uint32_t bytes)
+{
+	return (uint32_t)(((uint64_t)bytes * MSEC_PER_SEC) / BIN_MS);
+}
+
+int throughput_summary_get(const struct throughput *t,
+			   struct throughput_summary *summary)
+{
+	uint32_t n;
+	uint64_t sum = 0;
+
+	if (t == NULL || summary == NULL) {
+		return -EINVAL;
+	}
+
+	if (t->count < 2) {
+		return -ENODATA;
+	}
+
+	/* The current bin is still being filled */
+	n = t->count - 1;
+
+	for (uint32_t i = 0; i < n; i++) {
+		sum += bin_bytes(t, i);
+	}
+
+	summary->bins = n;
+	summary->min = bin_rate(bin_kth(t, n, 0));
+	summary->median = bin_rate(bin_kth(t, n, (n - 1) / 2));
+	/* Nearest-rank 90th percentile */
+	summary->p90 = bin_rate(bin_kth(t, n, (n * 9 + 9) / 10 - 1));
+	summary->max = bin_rate(bin_kth(t, n, n - 1));
+	summary->mean = bin_rate((uint32_t)(sum / n));
+
+	return 0;
+}
+
+/* Integer square root, rounded down */
+static uint64_t isqrt(uint64_t v)
+{
+	uint64_t root = 0;
+	uint64_t bit = 1ULL << 62;
+
+	while (bit > v) {
+		bit >>= 2;
+	}
+
+	while (bit) {
+		if (v >= root + bit) {
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+int throughput_estimate_get(const struct throughput *t, uint32_t skip_ms,
+			    struct throughput_estimate *est)
+{
+	uint32_t n;
+	uint32_t used = 0;
+	uint64_t b;
+	uint64_t sum = 0;
+	uint64_t sum_sq = 0;
+	uint64_t var;
+
+	if (t == NULL || est == NULL) {
+		return -EINVAL;
+	}
+
+	if (t->count < 2) {
+		return -ENODATA;
+	}
+
+	/* The current bin is still being filled */
+	n = t->count - 1;
+
+	for (uint32_t i = 0; i < n; i++) {
+		if (bin_get(t, i)->t_ms < skip_ms) {
+			continue;
+		}
+		b = bin_bytes(t, i);
+		sum += b;
+		sum_sq += b * b;
+		used++;
+	}
+
+	if (used < 2) {
+		return -ENODATA;
+	}
+
+	/* Sample variance of the bytes per bin */
+	var = (sum_sq - (sum * sum) / used) / (used - 1);
+
+	est->bins = used;
+	est->mean = bin_rate((uint32_t)(sum / used));
+	est->ci = bin_rate((uint32_t)isqrt((Z95_SQ_X100 * var) / (100 * used)));
+
+	return 0;
+}
+
+bool throughput_estimate_converged(const struct throughput_estimate *est,
+				   uint32_t tolerance_pct)
+{
+	if (est->bins < CONFIG_THROUGHPUT_ESTIMATE_MIN_BINS || est->mean == 0) {
+		return false;
+	}
+
+	return (uint64_t)est->ci * 100 <= (uint64_t)est->mean * tolerance_pct;
+}
+
+void throughput_print(const struct throughput *t, const char *name)
+{
+	struct throughput_summary summary;
+	uint32_t n;
+
+	if (throughput_summary_get(t, &summary)) {
+		printk("%s: not enough samples\n", name);
+		return;
+	}
+
+	printk("%s: %u x %d ms bins, bytes per sec min %u, median %u, p90 %u, max %u\n",
+	       name, summary.bins, BIN_MS, summary.min, summary.median,
+	       summary.p90, summary.max);
+
+	/* Throughput over time, in bytes per sec */
+	n = t->count - 1;
+	for (uint32_t i = 0; i < n; i++) {
+		if ((i % CURVE_BINS_PER_LINE) == 0) {
+			printk("%s%6u ms:", (i ? "\n" : ""),
+			       bin_get(t, i)->t_ms);
+		}
+		printk(" %u", bin_rate(bin_bytes(t, i)));
+	}
+	printk("\n");
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+/**@file transport.h
+ *
+ * @defgroup transport Transport shared by the download and upload clients
+ * @{
+ * @brief Socket setup and I/O buffers for the speedtest clients.
+ *
+ * @details The transport provides APIs for:
+ *  - parsing a URL once into its parts,
+ *  - connecting a non-blocking socket to the host of a URL,
+ *  - sending a buffer over a non-blocking socket,
+ *  - timestamping the phases of a connection and of a transfer,
+ *  - leasing I/O buffers from a fixed pool shared by all sessions.
+ *
+ * The pool records how many buffers were in use at most, so the pool
+ * can be sized to the actual peak.
+ */
+
+#ifndef TRANSPORT_H__
+#define TRANSPORT_H__
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <net/socket.h>
+
+/* Specified here as these are not defined in prj.conf */
+#define CONFIG_TRANSPORT_BUF_SIZE 2048
+#define CONFIG_TRANSPORT_BUF_COUNT 6
+#define CONFIG_TRANSPORT_URL_HOST_SIZE 64
+#define CONFIG_TRANSPORT_URL_PATH_SIZE 192
+
+#define TRANSPORT_LOG_LEVEL 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief URL, split into its parts.
+ */
+struct url {
+	/** Protocol given by the scheme, zero if there is none. */
+	int proto;
+	/** Socket type given by the scheme, zero if there is none. */
+	int type;
+	/** Host name, null-terminated. */
+	char host[CONFIG_TRANSPORT_URL_HOST_SIZE];
+	/** Port, zero if not specified. */
+	uint16_t port;
+	/** Path, without the leading slash, null-terminated. */
+	char path[CONFIG_TRANSPORT_URL_PATH_SIZE];
+};
+
+/**
+ * @brief Connection options.
+ */
+struct transport_cfg {
+	/** Access point name, or NULL to use the default APN. */
+	const char *apn;
+	/** TLS security tags, or NULL to disable TLS. */
+	const int *sec_tag_array;
+	/** Number of security tags. */
+	int sec_tag_array_sz;
+	/** Enable TLS session caching in the modem. */
+	bool session_cache;
+};
+
+/**
+ * @brief Events in the life of a connection and of a transfer on it,
+ *	  in the order they occur.
+ */
+enum transport_phase {
+	/** Host name lookup started. */
+	TRANSPORT_PHASE_DNS_START,
+	/** Host name lookup done. */
+	TRANSPORT_PHASE_DNS_END,
+	/** Connection established, plain TCP only. */
+	TRANSPORT_PHASE_CONNECT,
+	/** Connection established and TLS handshake done. The modem
+	 *  performs the handshake as part of connect(), so the two
+	 *  cannot be told apart.
+	 */
+	TRANSPORT_PHASE_TLS,
+	/** Request handed to the socket. */
+	TRANSPORT_PHASE_REQUEST_SENT,
+	/** First payload byte transferred. */
+	TRANSPORT_PHASE_FIRST_BYTE,
+	/** Last payload byte transferred. */
+	TRANSPORT_PHASE_LAST_BYTE,
+
+	TRANSPORT_PHASE_COUNT
+};
+
+/**
+ * @brief Timestamps of the phases of a connection and of a transfer.
+ */
+struct transport_timing {
+	/** High-resolution time at each phase, in cycles. */
+	uint64_t cycles[TRANSPORT_PHASE_COUNT];
+	/** Bit mask of the phases reached. */
+	uint32_t reached;
+};
+
+/**
+ * @brief I/O buffer pool statistics.
+ */
+struct transport_buf_stats {
+	/** Size of each buffer, in bytes. */
+	size_t size;
+	/** Number of buffers in the pool. */
+	uint32_t count;
+	/** Buffers currently leased. */
+	uint32_t used;
+	/** Most buffers leased at the same time. */
+	uint32_t max_used;
+};
+
+/**
+ * @brief Parse a URL.
+ *
+ * Accepts "[scheme://]host[:port][/path]".
+ *
+ * @param[in]  url	URL, null-terminated.
+ * @param[out] u	Parsed URL.
+ *
+ * @retval int Zero on success, -E2BIG if the host or path does not fit,
+ *	       -EINVAL if the port is not valid.
+ */
+int url_parse(const char *url, struct url *u);
+
+/**
+ * @brief Connect to the host of a URL.
+ *
+ * The protocol and port are taken from the URL, and default to HTTPS
+ * when security tags are given and HTTP otherwise. The socket is made
+ * non-blocking once connected.
+ *
+ * @param[in]  url	Parsed URL of the host.
+ * @param[in]  cfg	Connection options.
+ * @param[out] proto	Protocol of the connection.
+ * @param[out] fd	Socket descriptor, -1 on failure.
+ * @param[out] timing	Timestamps of the connection phases. Those of
+ *			the transfer are left untouched.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int transport_connect(const struct url *url, const struct transport_cfg *cfg,
+		      int *proto, int *fd, struct transport_timing *timing);
+
+/**
+ * @brief Send the concatenation of several buffers over a non-blocking socket.
+ *
+ * The pieces are handed to sendmsg() together, so that they leave in as
+ * few segments as possible. Sends as much as the socket takes without
+ * waiting. When it is full, call again with the same pieces once the
+ * socket is writable to send the rest.
+ *
+ * @param[in]     fd	Socket descriptor.
+ * @param[in,out] iov	Pieces to send. They are consumed in place: bases
+ *			and lengths are advanced past the bytes sent.
+ * @param[in]     iovcnt	Number of pieces.
+ *
+ * @retval int Zero once all pieces are sent, -EAGAIN if the socket is
+ *	       full with some left, another negative error code otherwise.
+ */
+int transport_sendv(int fd, struct iovec *iov, size_t iovcnt);
+
+/**
+ * @brief Forget a phase and all the phases after it.
+ *
+ * @param[in] timing	Timestamps.
+ * @param[in] from	First phase to forget.
+ */
+void transport_timing_reset(struct transport_timing *timing,
+			    enum transport_phase from);
+
+/**
+ * @brief Record that a phase has been reached now.
+ *
+ * @param[in] timing	Timestamps.
+ * @param[in] phase	Phase reached, its previous timestamp is replaced.
+ */
+void transport_timing_mark(struct transport_timing *timing,
+			   enum transport_phase phase);
+
+/**
+ * @brief Whether a phase has been reached.
+ *
+ * @param[in] timing	Timestamps.
+ * @param[in] phase	Phase.
+ *
+ * @return true if the phase has a timestamp.
+ */
+bool transport_timing_reached(const struct transport_timing *timing,
+			      enum transport_phase phase);
+
+/**
+ * @brief Retrieve the time between two phases, in microseconds.
+ *
+ * The resolution is that of the hardware cycle counter.
+ *
+ * @param[in]  timing	Timestamps.
+ * @param[in]  from	Earlier phase.
+ * @param[in]  to	Later phase.
+ * @param[out] us	Time elapsed.
+ *
+ * @retval int Zero on success, -ENODATA if either phase was not reached.
+ */
+int transport_timing_us(const struct transport_timing *timing,
+			enum transport_phase from, enum transport_phase to,
+			uint32_t *us);
+
+/**
+ * @brief Lease a buffer of @option{CONFIG_TRANSPORT_BUF_SIZE} bytes.
+ *
+ * @return The buffer, or NULL if all buffers are leased.
+ */
+void *transport_buf_lease(void);
+
+/**
+ * @brief Return a leased buffer to the pool.
+ *
+ * @param[in] buf	Buffer, or NULL.
+ */
+void transport_buf_release(void *buf);
+
+/**
+ * @brief Retrieve buffer pool statistics.
+ *
+ * @param[out] stats	Statistics.
+ */
+void transport_buf_stats_get(struct transport_buf_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRANSPORT_H__ */
+
+/**@} */
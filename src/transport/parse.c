@@ -9,6 +9,7 @@
 #include <net/socket.h>
 #include <zephyr/types.h>
 #include <errno.h>
+#include "transport.h"
 
 static int swallow(const char **str, const char *swallow)
 {
@@ -96,7 +97,7 @@ int url_parse_port(const char *url, uint16_t *port)
 		len = end - cur;
 	}
 
-	len = MAX(len, sizeof(aport) - 1);
+	len = MIN(len, sizeof(aport) - 1);
 
 	memcpy(aport, cur, len);
 	aport[len] = '\0';
@@ -135,3 +136,62 @@ int url_parse_file(const char *url, char *file, size_t len)
 
 	return 0;
 }
+
+int url_parse(const char *url, struct url *u)
+{
+	const char *cur;
+	const char *p;
+	size_t len;
+	uint32_t port;
+
+	u->proto = 0;
+	u->type = 0;
+	u->port = 0;
+
+	cur = url;
+
+	p = strstr(cur, "://");
+	if (p) {
+		/* Unknown schemes are treated as no scheme at all */
+		(void)url_parse_proto(cur, &u->proto, &u->type);
+		cur = p + strlen("://");
+	}
+
+	len = strcspn(cur, ":/");
+	if (len + 1 > sizeof(u->host)) {
+		return -E2BIG;
+	}
+
+	memcpy(u->host, cur, len);
+	u->host[len] = '\0';
+	cur += len;
+
+	if (*cur == ':') {
+		cur++;
+		port = 0;
+		for (p = cur; *p >= '0' && *p <= '9'; p++) {
+			port = port * 10 + (*p - '0');
+			if (port > UINT16_MAX) {
+				return -EINVAL;
+			}
+		}
+		if (p == cur) {
+			return -EINVAL;
+		}
+		u->port = port;
+		cur = p;
+	}
+
+	if (*cur == '/') {
+		cur++;
+	}
+
+	len = strlen(cur);
+	if (len + 1 > sizeof(u->path)) {
+		return -E2BIG;
+	}
+
+	memcpy(u->path, cur, len + 1);
+
+	return 0;
+}
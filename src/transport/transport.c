@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-BSD-5-Clause-Nordic
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <net/socket.h>
+#include <nrf_socket.h>
+#include <net/tls_credentials.h>
+#include "transport.h"
+#include "dns_cache.h"
+#include "hrtime.h"
+#include <logging/log.h>
+
+LOG_MODULE_REGISTER(transport, TRANSPORT_LOG_LEVEL);
+
+#define SIN6(A) ((struct sockaddr_in6 *)(A))
+#define SIN(A) ((struct sockaddr_in *)(A))
+
+#ifndef TLS_SESSION_CACHE
+/* Not exported by older Zephyr trees, the offloaded modem sockets
+ * accept it nonetheless.
+ */
+#define TLS_SESSION_CACHE 12
+#endif
+
+K_MEM_SLAB_DEFINE(buf_slab, CONFIG_TRANSPORT_BUF_SIZE,
+		  CONFIG_TRANSPORT_BUF_COUNT, 4);
+
+static K_MUTEX_DEFINE(buf_lock);
+static uint32_t buf_max_used;
+
+static const char *str_family(int family)
+{
+	switch (family) {
+	case AF_INET:
+		return "IPv4";
+	case AF_INET6:
+		return "IPv6";
+	default:
+		__ASSERT(false, "Unsupported family");
+		return NULL;
+	}
+}
+
+static int socket_nonblock_set(int fd)
+{
+	int err;
+
+	err = fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (err) {
+		LOG_ERR("Failed to set socket non-blocking, errno %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int socket_sectag_set(int fd, const int *sec_tag_array,
+			     int sec_tag_array_sz)
+{
+	int err;
+	int verify;
+
+	enum {
+		NONE = 0,
+		OPTIONAL = 1,
+		REQUIRED = 2,
+	};
+
+	verify = REQUIRED;
+
+	err = setsockopt(fd, SOL_TLS, TLS_PEER_VERIFY, &verify, sizeof(verify));
+	if (err) {
+		LOG_ERR("Failed to setup peer verification, errno %d", errno);
+		return -errno;
+	}
+
+	LOG_INF("Setting up TLS credentials array");
+	err = setsockopt(fd, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_array,
+			 sizeof(sec_tag_t) * sec_tag_array_sz);
+	if (err) {
+		LOG_ERR("Failed to setup socket security tag, errno %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int socket_session_cache_set(int fd, bool enable)
+{
+	int err;
+	int cache = enable ? 1 : 0;
+
+	LOG_INF("TLS session cache %s", enable ? "enabled" : "disabled");
+
+	err = setsockopt(fd, SOL_TLS, TLS_SESSION_CACHE, &cache, sizeof(cache));
+	if (err && errno == ENOPROTOOPT) {
+		/* Not fatal, the connection just won't be resumed */
+		LOG_WRN("TLS session cache not supported");
+		return 0;
+	}
+	if (err) {
+		LOG_ERR("Failed to set TLS session cache, errno %d", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int socket_apn_set(int fd, const char *apn)
+{
+	int err;
+	size_t len;
+
+	__ASSERT_NO_MSG(apn);
+
+	len = strlen(apn);
+	if (len >= IFNAMSIZ) {
+		LOG_ERR("Access point name is too long.");
+		return -EINVAL;
+	}
+
+	LOG_INF("Setting up APN: %s", log_strdup(apn));
+
+	err = setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, apn, len);
+	if (err) {
+		LOG_ERR("Failed to bind socket to network \"%s\", err %d",
+			log_strdup(apn), errno);
+		return -ENETUNREACH;
+	}
+
+	return 0;
+}
+
+int transport_connect(const struct url *url, const struct transport_cfg *cfg,
+		      int *proto, int *fd, struct transport_timing *timing)
+{
+	int err = -EHOSTUNREACH;
+	int type;
+	uint16_t port;
+	socklen_t addrlen;
+	struct sockaddr sa;
+	uint32_t connect_us;
+
+	*fd = -1;
+
+	/* A transfer may span reconnects, only the connection is timed anew */
+	timing->reached &= ~(BIT(TRANSPORT_PHASE_DNS_END) |
+			     BIT(TRANSPORT_PHASE_CONNECT) |
+			     BIT(TRANSPORT_PHASE_TLS));
+	transport_timing_mark(timing, TRANSPORT_PHASE_DNS_START);
+
+	/* Attempt IPv6 connection if configured, fallback to IPv4 */
+	if (IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_IPV6)) {
+		err = dns_cache_lookup(url->host, AF_INET6, cfg->apn, &sa);
+	}
+	if (err) {
+		err = dns_cache_lookup(url->host, AF_INET, cfg->apn, &sa);
+	}
+	if (err) {
+		return err;
+	}
+
+	transport_timing_mark(timing, TRANSPORT_PHASE_DNS_END);
+
+	*proto = url->proto;
+	type = url->type;
+	if (!*proto) {
+		LOG_DBG("Protocol not specified, defaulting to HTTP(S)");
+		type = SOCK_STREAM;
+		if (cfg->sec_tag_array != NULL) {
+			*proto = IPPROTO_TLS_1_2;
+		} else {
+			*proto = IPPROTO_TCP;
+		}
+	}
+
+	if (*proto == IPPROTO_UDP || *proto == IPPROTO_DTLS_1_2) {
+		return -EPROTONOSUPPORT;
+	}
+
+	if (*proto == IPPROTO_TLS_1_2 && cfg->sec_tag_array == NULL) {
+		LOG_WRN("No security tag provided for TLS/DTLS");
+		return -EINVAL;
+	}
+
+	port = url->port;
+	if (!port) {
+		port = (*proto == IPPROTO_TLS_1_2) ? 443 : 80;
+		LOG_DBG("Port not specified, using default: %d", port);
+	}
+
+	switch (sa.sa_family) {
+	case AF_INET6:
+		SIN6(&sa)->sin6_port = htons(port);
+		addrlen = sizeof(struct sockaddr_in6);
+		break;
+	case AF_INET:
+		SIN(&sa)->sin_port = htons(port);
+		addrlen = sizeof(struct sockaddr_in);
+		break;
+	default:
+		return -EAFNOSUPPORT;
+	}
+
+	LOG_DBG("family: %d, type: %d, proto: %d",
+		sa.sa_family, type, *proto);
+
+	*fd = socket(sa.sa_family, type, *proto);
+	if (*fd < 0) {
+		LOG_ERR("Failed to create socket, err %d", errno);
+		return -errno;
+	}
+
+	if (cfg->apn != NULL && strlen(cfg->apn)) {
+		err = socket_apn_set(*fd, cfg->apn);
+		if (err) {
+			goto cleanup;
+		}
+	}
+
+	if (*proto == IPPROTO_TLS_1_2) {
+		err = socket_sectag_set(*fd, cfg->sec_tag_array,
+					cfg->sec_tag_array_sz);
+		if (err) {
+			goto cleanup;
+		}
+
+		err = socket_session_cache_set(*fd, cfg->session_cache);
+		if (err) {
+			goto cleanup;
+		}
+	}
+
+	LOG_INF("Connecting to %s", log_strdup(url->host));
+	LOG_DBG("fd %d, addrlen %d, fam %s, port %d",
+		*fd, addrlen, str_family(sa.sa_family), port);
+
+	err = connect(*fd, &sa, addrlen);
+	if (err) {
+		LOG_ERR("Unable to connect, errno %d", errno);
+		err = -errno;
+		goto cleanup;
+	}
+
+	/* The modem does the TLS handshake inside connect() */
+	transport_timing_mark(timing, (*proto == IPPROTO_TLS_1_2) ?
+			      TRANSPORT_PHASE_TLS : TRANSPORT_PHASE_CONNECT);
+
+	transport_timing_us(timing, TRANSPORT_PHASE_DNS_END,
+			    (*proto == IPPROTO_TLS_1_2) ?
+			    TRANSPORT_PHASE_TLS : TRANSPORT_PHASE_CONNECT,
+			    &connect_us);
+	LOG_INF("Connected in %u us", connect_us);
+
+	/* Reads and writes are driven by the event loop */
+	err = socket_nonblock_set(*fd);
+
+cleanup:
+	if (err) {
+		/* Unable to connect, close socket */
+		close(*fd);
+		*fd = -1;
+	}
+
+	return err;
+}
+
+int transport_sendv(int fd, struct iovec *iov, size_t iovcnt)
+{
+	ssize_t sent;
+	size_t n;
+	struct msghdr msg = { 0 };
+
+	while (iovcnt) {
+		if (iov->iov_len == 0) {
+			/* Sent by an earlier call */
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+
+		sent = sendmsg(fd, &msg, 0);
+		if (sent < 0 && (errno == EOPNOTSUPP || errno == ENOTSUP)) {
+			/* No gather support, one piece at a time */
+			sent = send(fd, iov->iov_base, iov->iov_len, 0);
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Socket buffer is full, the caller waits for room */
+			return -EAGAIN;
+		}
+		if (sent <= 0) {
+			return -errno;
+		}
+
+		/* Advance past what was sent */
+		while (sent) {
+			n = MIN((size_t)sent, iov->iov_len);
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+			sent -= n;
+			if (iov->iov_len == 0) {
+				iov++;
+				iovcnt--;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void transport_timing_reset(struct transport_timing *timing,
+			    enum transport_phase from)
+{
+	timing->reached &= BIT(from) - 1;
+}
+
+void transport_timing_mark(struct transport_timing *timing,
+			   enum transport_phase phase)
+{
+	timing->cycles[phase] = hrtime_now();
+	timing->reached |= BIT(phase);
+}
+
+bool transport_timing_reached(const struct transport_timing *timing,
+			      enum transport_phase phase)
+{
+	return (timing->reached & BIT(phase)) != 0;
+}
+
+int transport_timing_us(const struct transport_timing *timing,
+			enum transport_phase from, enum transport_phase to,
+			uint32_t *us)
+{
+	if (!transport_timing_reached(timing, from) ||
+	    !transport_timing_reached(timing, to)) {
+		return -ENODATA;
+	}
+
+	*us = (uint32_t)MIN(hrtime_to_us(timing->cycles[to] -
+					 timing->cycles[from]), UINT32_MAX);
+
+	return 0;
+}
+
+void *transport_buf_lease(void)
+{
+	void *buf;
+
+	if (k_mem_slab_alloc(&buf_slab, &buf, K_NO_WAIT)) {
+		LOG_ERR("No free I/O buffer");
+		return NULL;
+	}
+
+	k_mutex_lock(&buf_lock, K_FOREVER);
+	buf_max_used = MAX(buf_max_used, k_mem_slab_num_used_get(&buf_slab));
+	k_mutex_unlock(&buf_lock);
+
+	return buf;
+}
+
+void transport_buf_release(void *buf)
+{
+	if (buf) {
+		k_mem_slab_free(&buf_slab, &buf);
+	}
+}
+
+void transport_buf_stats_get(struct transport_buf_stats *stats)
+{
+	stats->size = CONFIG_TRANSPORT_BUF_SIZE;
+	stats->count = CONFIG_TRANSPORT_BUF_COUNT;
+	stats->used = k_mem_slab_num_used_get(&buf_slab);
+
+	k_mutex_lock(&buf_lock, K_FOREVER);
+	stats->max_used = buf_max_used;
+	k_mutex_unlock(&buf_lock);
+}
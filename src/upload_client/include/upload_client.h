@@ -23,15 +23,20 @@
 #include <zephyr.h>
 #include <zephyr/types.h>
 #include <net/coap.h>
+#include "event_loop.h"
+#include "transport.h"
+#include "throughput.h"
 
 /* Lifted from autoconf.h of another build */
-#define CONFIG_DOWNLOAD_CLIENT_BUF_SIZE 2048
+#define CONFIG_DOWNLOAD_CLIENT_BUF_SIZE CONFIG_TRANSPORT_BUF_SIZE
 #define CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE 2048
 #define CONFIG_DOWNLOAD_CLIENT_HTTP_FRAG_SIZE_2048 1
-#define CONFIG_DOWNLOAD_CLIENT_STACK_SIZE 4096
 #define CONFIG_DOWNLOAD_CLIENT_MAX_HOSTNAME_SIZE 64
 #define CONFIG_DOWNLOAD_CLIENT_MAX_FILENAME_SIZE 192
 #define CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS 4000
+#define CONFIG_UPLOAD_CLIENT_IOV_COUNT 8
+#define CONFIG_UPLOAD_CLIENT_CHUNK_MIN 512
+#define CONFIG_UPLOAD_CLIENT_CHUNK_MAX 4096
 
 #define USE_SEC_TAG_ARRAY /* MQ  Allow upload_client lib to accept array of security tags instead of just one. */
 
@@ -45,7 +50,17 @@ extern "C" {
 enum upload_client_evt_id {
 	/**
 	 * Event contains a fragment.
-	 * The application may return any non-zero value to stop the upload.
+	 * The application may return any non-zero value to abort the
+	 * upload. The request is then left incomplete, so the application
+	 * should disconnect before uploading again.
+	 *
+	 * The event carries the number of bytes the client wants in
+	 * the fragment length. The application sets the fragment buffer,
+	 * and may lower the length. Fragments are queued and sent in
+	 * batches, so the buffer must be left unchanged until it has been
+	 * sent. At most @option{CONFIG_UPLOAD_CLIENT_CHUNK_MAX} bytes of
+	 * fragments are queued at any time, so a ring buffer of that size
+	 * can be refilled in order.
 	 */
 	UPLOAD_CLIENT_EVT_FRAGMENT,
 	/**
@@ -55,6 +70,7 @@ enum upload_client_evt_id {
 	 * Error reason may be one of the following:
 	 * - ECONNRESET: socket error, peer closed connection
 	 * - EHOSTDOWN: host went down during download
+	 * - ETIMEDOUT: the server did not answer the request in time
 	 * - EBADMSG: HTTP response header not as expected
 	 * - E2BIG: HTTP response header could not fit in buffer
 	 *
@@ -69,7 +85,27 @@ enum upload_client_evt_id {
 	 * network socket as necessary before re-attempting the upload.
 	 */
 	UPLOAD_CLIENT_EVT_ERROR,
-	/** Upload complete. */
+	/**
+	 * The whole request of the current POST has been handed to the
+	 * socket.
+	 * Data may still be in flight, the client now waits for
+	 * the server to respond.
+	 */
+	UPLOAD_CLIENT_EVT_SENT,
+	/**
+	 * The server has responded to a POST.
+	 * The event contains the response.
+	 *
+	 * The application may return zero to post the same amount again
+	 * on the same connection, or any non-zero value to finish the
+	 * upload. The upload also finishes if the server closes the
+	 * connection.
+	 */
+	UPLOAD_CLIENT_EVT_RESPONSE,
+	/**
+	 * Upload complete, the server has responded to the last POST.
+	 * The event contains the last response.
+	 */
 	UPLOAD_CLIENT_EVT_DONE,
 };
 
@@ -78,18 +114,33 @@ struct upload_fragment {
 	size_t len;
 };
 
+struct upload_response {
+	/** HTTP status code. */
+	int status;
+	/** Number of bytes the server reports as received,
+	 *  from "size=" in the response body. Zero if not reported.
+	 */
+	size_t size;
+};
+
+struct upload_client;
+
 /**
  * @brief Upload client event.
  */
 struct upload_client_evt {
 	/** Event ID. */
 	enum upload_client_evt_id id;
+	/** Client instance the event comes from. */
+	struct upload_client *client;
 
 	union {
 		/** Error cause. */
 		int error;
 		/** Fragment data. */
 		struct upload_fragment fragment;
+		/** Server response. */
+		struct upload_response response;
 	};
 };
 
@@ -106,6 +157,10 @@ struct upload_client_cfg {
 	 *  values shall be used.
 	 */
 	size_t frag_size_override;
+	/** Sampler the bytes taken by the socket are accounted to, or NULL.
+	 *  Several clients may share one.
+	 */
+	struct throughput *throughput;
 	/** TLS security tag.
 	 *  Pass -1 to disable TLS.
 	 */
@@ -127,6 +182,9 @@ struct upload_client_cfg {
  * If the callback returns a non-zero value, the download stops.
  * To resume the download, use @ref upload_client_start().
  *
+ * The callback runs on the event loop thread, other sessions are not
+ * serviced until it returns.
+ *
  * @param[in] event	The event.
  *
  * @return Zero to continue the download, non-zero otherwise.
@@ -140,26 +198,56 @@ typedef int (*upload_client_callback_t)(
 struct upload_client {
 	/** Socket descriptor. */
 	int fd;
-	/** Response buffer. */
-	char buf[CONFIG_DOWNLOAD_CLIENT_BUF_SIZE];
+	/** Request buffer, leased from the transport from the start
+	 *  of the first upload until disconnecting.
+	 */
+	char *buf;
 	/** Buffer offset. */
 	size_t offset;
+	/** Request pieces and fragments queued for the next sendmsg(). */
+	struct iovec iov[CONFIG_UPLOAD_CLIENT_IOV_COUNT];
+	/** Number of queued pieces. */
+	size_t iov_count;
+	/** The postamble has been queued. */
+	bool last;
+	/** Payload bytes still to be queued for the current POST. */
+	size_t post_left;
+	/** Number of POSTs the server has responded to. */
+	uint32_t posts;
+	/** Number of send calls that moved data, for the current upload. */
+	uint32_t send_calls;
+	/** Bytes offered per send call. Starts at
+	 *  @option{CONFIG_UPLOAD_CLIENT_CHUNK_MIN}, doubles while the socket
+	 *  takes all of it, up to @option{CONFIG_UPLOAD_CLIENT_CHUNK_MAX},
+	 *  and halves when the socket takes only part of it.
+	 */
+	size_t chunk_size;
+	/** Largest chunk size reached, for the current upload. */
+	size_t chunk_size_peak;
 
-	/** Size of the file being uploaded, in bytes. */
+	/** Payload size of each POST, in bytes. */
 	size_t file_size;
-	/** Upload progress, number of bytes downloaded. */
+	/** Upload progress, number of bytes taken by the socket
+	 *  over all POSTs, headers included.
+	 */
 	size_t progress;
 
 	/** Server hosting the file, null-terminated. */
 	const char *host;
 	/** File name, null-terminated. */
 	const char *file;
+	/** Host and file, parsed once on connect and start. */
+	struct url url;
 #ifndef USE_SEC_TAG_ARRAY	
 	/** Configuration options. */
 	struct upload_client_cfg config;
 #endif	
 	/** Protocol for current download. */
 	int proto;
+	/** Timestamps of the connection setup and of the current
+	 *  or last upload.
+	 */
+	struct transport_timing timing;
 
 	struct  {
 		/** Whether the HTTP header for
@@ -168,6 +256,10 @@ struct upload_client {
 		bool has_header;
 		/** The server has closed the connection. */
 		bool connection_close;
+		/** The request has been sent, waiting for the response. */
+		bool response_pending;
+		/** Response received so far. */
+		struct upload_response response;
 	} http;
 
 	struct {
@@ -175,13 +267,10 @@ struct upload_client {
 		struct coap_block_context block_ctx;
 	} coap;
 
-	/** Internal thread ID. */
-	k_tid_t tid;
-	/** Internal download thread. */
-	struct k_thread thread;
-	/* Internal thread stack. */
-	K_THREAD_STACK_MEMBER(thread_stack,
-			      CONFIG_DOWNLOAD_CLIENT_STACK_SIZE);
+	/** Event loop session servicing the socket. */
+	struct event_loop_session session;
+	/** Set by the first initialization. */
+	bool initialized;
 
 	/** Event handler. */
 	upload_client_callback_t callback;
@@ -196,6 +285,10 @@ struct upload_client {
 /**
  * @brief Initialize the download client.
  *
+ * A client that was initialized before is disconnected first, its socket
+ * is closed and its buffer returned. The client must be zeroed before it
+ * is first initialized, as static instances are.
+ *
  * @param[in] client	Client instance.
  * @param[in] callback	Callback function.
  *
@@ -263,6 +356,22 @@ void upload_client_resume(struct upload_client *client);
  */
 int upload_client_file_size_get(struct upload_client *client, size_t *size);
 
+/**
+ * @brief Retrieve the timestamps of the connection setup and of the
+ *	  current or last upload.
+ *
+ * The request header leaves with the first payload bytes, so the request
+ * and the first byte are timed by the same send call. The last byte is
+ * timed by the server's response to the last POST, which acknowledges it.
+ *
+ * @param[in]  client	Client instance.
+ * @param[out] timing	Timestamps.
+ *
+ * @retval int Zero on success, a negative error code otherwise.
+ */
+int upload_client_timing_get(struct upload_client *client,
+			     struct transport_timing *timing);
+
 /**
  * @brief Disconnect from the server.
  *
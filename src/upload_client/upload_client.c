@@ -5,457 +5,454 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <zephyr.h>
 #include <zephyr/types.h>
 #include <toolchain/common.h>
 #include <net/socket.h>
-#include <nrf_socket.h>
-#include <net/tls_credentials.h>
 #include "upload_client.h"
+#include "event_loop.h"
+#include "transport.h"
 
 
-#define SIN6(A) ((struct sockaddr_in6 *)(A))
-#define SIN(A) ((struct sockaddr_in *)(A))
-
-#define HOSTNAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_HOSTNAME_SIZE
-#define FILENAME_SIZE CONFIG_DOWNLOAD_CLIENT_MAX_FILENAME_SIZE
-
-int url_parse_port(const char *url, uint16_t *port);
-int url_parse_proto(const char *url, int *proto, int *type);
-int url_parse_host(const char *url, char *host, size_t len);
 int url_parse_file(const char *url, char *file, size_t len);
 
 int http_parse(struct upload_client *client, size_t len);
-static int http_post_request_send(struct upload_client *client);
-static int socket_send(const int fd, const char* buf, size_t len);
+static int http_post_request_build(struct upload_client *client);
 
-static int socket_timeout_set(int fd)
-{
-	int err;
+#define POST_BOUNDARY "------------------------76a17771c6949e06"
 
-	if (CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS == SYS_FOREVER_MS) {
-		return 0;
-	}
+#define POST_HTTPS_TEMPLATE_PREAMBLE                                      \
+		"POST /%s HTTP/1.1\r\n"                                                 \
+		"Host: %s\r\n"                                                         \
+		"User-Agent: nRF91/0.1\r\n"                                           \
+		"Accept: */*\r\n"															\
+		"Content-Length: %u\r\n"													\
+		"Content-Type: multipart/form-data; "									\
+		"boundary=" POST_BOUNDARY "\r\n\r\n"
+	#define POST_HTTPS_TEMPLATE_MIDAMBLE									\
+		"--" POST_BOUNDARY "\r\n"								\
+		"Content-Disposition: form-data; name=\"filename\"; filename=\"test5.dat\"\r\n" \
+		"Content-Type: application/octet-stream\r\n\r\n"
 
-	const uint32_t timeout_ms = CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS;
+	#define POST_HTTPS_TEMPLATE_POSTAMBLE										\
+		"\r\n--" POST_BOUNDARY "--\r\n"
 
-	struct timeval timeo = {
-		.tv_sec = (timeout_ms / 1000),
-		.tv_usec = (timeout_ms % 1000) * 1000,
-	};
+/* Multipart framing around the payload, part of the Content-Length */
+#define POST_MULTIPART_LEN (sizeof(POST_HTTPS_TEMPLATE_MIDAMBLE) - 1 + \
+			    sizeof(POST_HTTPS_TEMPLATE_POSTAMBLE) - 1)
 
-	err = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
-	if (err) {
-		printk("Failed to set socket timeout, errno %d", errno);
-		return -errno;
+/* Queue a piece of the request body, returns the number of free slots */
+static size_t iov_push(struct upload_client *client, const void *buf,
+		       size_t len)
+{
+	if (len) {
+		client->iov[client->iov_count].iov_base = (void *)buf;
+		client->iov[client->iov_count].iov_len = len;
+		client->iov_count++;
 	}
 
-	return 0;
+	return CONFIG_UPLOAD_CLIENT_IOV_COUNT - client->iov_count;
 }
 
-#ifdef USE_SEC_TAG_ARRAY
-static int socket_sectag_set(int fd, uint32_t* sec_tag_array, int sec_tag_array_sz)
-#else
-static int socket_sectag_set(int fd, int sec_tag)	
-#endif
+/* Bytes queued for the next send call */
+static size_t iov_bytes(const struct upload_client *client)
 {
-	int err;
-	int verify;
-#ifndef USE_SEC_TAG_ARRAY
-	sec_tag_t sec_tag_list[] = { sec_tag };
-#endif
+	size_t len = 0;
 
-	enum {
-		NONE = 0,
-		OPTIONAL = 1,
-		REQUIRED = 2,
-	};
-
-	verify = REQUIRED;
-
-	err = setsockopt(fd, SOL_TLS, TLS_PEER_VERIFY, &verify, sizeof(verify));
-	if (err) {
-		printk("Failed to setup peer verification, errno %d", errno);
-		return -errno;
+	for (size_t i = 0; i < client->iov_count; i++) {
+		len += client->iov[i].iov_len;
 	}
 
-#ifdef USE_SEC_TAG_ARRAY
-	//LOG_INF("Setting up TLS credentials array");
-	err = setsockopt(fd, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_array,
-			 sizeof(sec_tag_t) * sec_tag_array_sz);
-#else
-	err = setsockopt(fd, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list,
-			 sizeof(sec_tag_t) * ARRAY_SIZE(sec_tag_list));
-#endif	
-	if (err) {
-		printk("Failed to setup socket security tag, errno %d", errno);
-		return -errno;
+	return len;
+}
+
+/* Drop the bytes sent from the front of the queue */
+static void iov_consume(struct upload_client *client, size_t sent)
+{
+	size_t i = 0;
+	size_t n;
+
+	while (sent && i < client->iov_count) {
+		n = MIN(sent, client->iov[i].iov_len);
+		client->iov[i].iov_base = (char *)client->iov[i].iov_base + n;
+		client->iov[i].iov_len -= n;
+		sent -= n;
+		if (client->iov[i].iov_len == 0) {
+			i++;
+		}
 	}
 
-	return 0;
+	client->iov_count -= i;
+	memmove(client->iov, client->iov + i,
+		client->iov_count * sizeof(client->iov[0]));
 }
 
-static int socket_apn_set(int fd, const char *apn)
+static int http_post_request_build(struct upload_client *client)
 {
-	int err;
-	size_t len;
+	int len;
 
-	__ASSERT_NO_MSG(apn);
+	__ASSERT_NO_MSG(client->host);
+	__ASSERT_NO_MSG(client->file);
 
-	len = strlen(apn);
-	if (len >= IFNAMSIZ) {
-		printk("Access point name is too long.");
-		return -EINVAL;
+	/* The whole body goes out in one request, over HTTP and HTTPS alike */
+	len = snprintf(client->buf, CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
+		       POST_HTTPS_TEMPLATE_PREAMBLE, client->url.path,
+		       client->url.host,
+		       (unsigned int)(client->file_size + POST_MULTIPART_LEN));
+
+	if (len < 0 || len >= CONFIG_DOWNLOAD_CLIENT_BUF_SIZE) {
+		printk("Cannot create POST request, buffer too small\n");
+		return -ENOMEM;
 	}
 
+	/* Pre-amble and mid-amble go out with the first payload */
+	client->offset = 0;
+	client->last = false;
+	client->post_left = client->file_size;
+	iov_push(client, client->buf, len);
+	iov_push(client, POST_HTTPS_TEMPLATE_MIDAMBLE,
+		 strlen(POST_HTTPS_TEMPLATE_MIDAMBLE));
 
-	err = setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, apn, len);
-	if (err) {
-		printk("Failed to bind socket to network, err %d", errno);
-		return -ENETUNREACH;
+	return 0;
+}
+
+static int request_send(struct upload_client *dl)
+{
+	switch (dl->proto) {
+		case IPPROTO_TCP:
+		case IPPROTO_TLS_1_2: {
+			return http_post_request_build(dl);
+		}
+		case IPPROTO_UDP:
+		case IPPROTO_DTLS_1_2:
+			break;
 	}
 
 	return 0;
 }
 
-static int host_lookup(const char *host, int family, const char *apn,
-		       struct sockaddr *sa)
+/* Deadline for the socket to become writable, or for the response */
+static int64_t session_deadline(void)
 {
-	int err;
-	struct addrinfo *ai;
-	char hostname[HOSTNAME_SIZE];
-
-	struct addrinfo hints = {
-		.ai_family = family,
-		.ai_next = apn ?
-			&(struct addrinfo) {
-				.ai_family    = AF_LTE,
-				.ai_socktype  = SOCK_MGMT,
-				.ai_protocol  = NPROTO_PDN,
-				.ai_canonname = (char *)apn
-			} : NULL,
-	};
+	return k_uptime_get() + CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS;
+}
 
-	/* Extract the hostname, without protocol or port */
-	err = url_parse_host(host, hostname, sizeof(hostname));
-	if (err) {
-		return err;
-	}
+static int evt_send(struct upload_client *client, struct upload_client_evt *evt)
+{
+	evt->client = client;
+	return client->callback(evt);
+}
 
-	err = getaddrinfo(hostname, NULL, &hints, &ai);
-	if (err) {
-		printk("Failed to resolve hostname\n");
-		return -EHOSTUNREACH;
-	}
+static int fragment_evt_send(struct upload_client *client,
+			     struct upload_client_evt *evt, size_t len)
+{
+	evt->id = UPLOAD_CLIENT_EVT_FRAGMENT;
+	evt->fragment.buf = 0;
+	evt->fragment.len = len;
+	return evt_send(client, evt);
+}
 
-	*sa = *(ai->ai_addr);
-	freeaddrinfo(ai);
+/* Offer more per call while the socket takes all of it,
+ * back off when it only takes part.
+ */
+static void chunk_adapt(struct upload_client *ul, size_t offered, size_t sent)
+{
+	if (sent == offered) {
+		ul->chunk_size = MIN(ul->chunk_size * 2,
+				     CONFIG_UPLOAD_CLIENT_CHUNK_MAX);
+	} else {
+		ul->chunk_size = MAX(ul->chunk_size / 2,
+				     CONFIG_UPLOAD_CLIENT_CHUNK_MIN);
+	}
 
-	return 0;
+	ul->chunk_size_peak = MAX(ul->chunk_size_peak, ul->chunk_size);
 }
 
-static int client_connect(struct upload_client *dl, const char *host,
-			  struct sockaddr *sa, int *fd)
+/* Send as much as the socket takes without blocking, a batch of
+ * fragments at a time.
+ * Returns non-zero when the upload is over.
+ */
+static int upload_send(struct upload_client *ul)
 {
-	int err;
-	int type;
-	uint16_t port;
-	socklen_t addrlen;
+	int rc;
+	ssize_t sent;
+	size_t offered;
+	size_t want;
+	struct msghdr msg = { 0 };
+	struct upload_client_evt upload_fragment_evt;
+	struct upload_client_evt evt_sent = {
+				.id = UPLOAD_CLIENT_EVT_SENT,
+			};
+	struct upload_client_evt evt_err = {
+				.id = UPLOAD_CLIENT_EVT_ERROR,
+			};
 
-	err = url_parse_proto(host, &dl->proto, &type);
-	if (err) {
-		printk("Protocol not specified, defaulting to HTTP(S)");
-		type = SOCK_STREAM;
-#ifdef USE_SEC_TAG_ARRAY
-		if (dl->config.sec_tag_array != NULL) {
-#else
-		if (dl->config.sec_tag != -1) {
-#endif			
-			dl->proto = IPPROTO_TLS_1_2;
-		} else {
-			dl->proto = IPPROTO_TCP;
+	while (true) {
+		/* Fill the batch up to the chunk size,
+		 * keeping a slot for the postamble.
+		 */
+		offered = iov_bytes(ul);
+		while (!ul->last && offered < ul->chunk_size &&
+		       ul->iov_count < CONFIG_UPLOAD_CLIENT_IOV_COUNT - 1) {
+			if (ul->post_left == 0) {
+				iov_push(ul, POST_HTTPS_TEMPLATE_POSTAMBLE,
+					 strlen(POST_HTTPS_TEMPLATE_POSTAMBLE));
+				ul->last = true;
+				break;
+			}
+			/* Ask for buffer from the application.
+			 * If the application callback returns non-zero, stop.
+			 */
+			want = MIN(ul->chunk_size - offered, ul->post_left);
+			rc = fragment_evt_send(ul, &upload_fragment_evt, want);
+			if (rc) {
+				/* Aborted, the request stays incomplete */
+				return 1;
+			}
+			__ASSERT(upload_fragment_evt.fragment.len <= want,
+				 "Fragment too long");
+			iov_push(ul, upload_fragment_evt.fragment.buf,
+				 upload_fragment_evt.fragment.len);
+			offered += upload_fragment_evt.fragment.len;
+			ul->post_left -= upload_fragment_evt.fragment.len;
 		}
-	}
 
-	if (dl->proto == IPPROTO_UDP || dl->proto == IPPROTO_DTLS_1_2) {
-		if (!IS_ENABLED(CONFIG_COAP)) {
-			return -EPROTONOSUPPORT;
+		if (ul->iov_count == 0) {
+			/* Everything is buffered, the clock stops on the
+			 * server's response.
+			 */
+			evt_send(ul, &evt_sent);
+			ul->http.response_pending = true;
+			ul->http.response = (struct upload_response) { 0 };
+			ul->offset = 0;
+			event_loop_session_set(&ul->session, POLLIN,
+					       session_deadline());
+			return 0;
 		}
-	}
 
-	if (dl->proto == IPPROTO_TLS_1_2 || dl->proto == IPPROTO_DTLS_1_2) {
-#ifdef USE_SEC_TAG_ARRAY
-		if (dl->config.sec_tag_array == NULL) {
-#else
-		if (dl->config.sec_tag == -1) {		
-#endif	
-			printk("No security tag provided for TLS/DTLS");
-			return -EINVAL;
+		/* Send out the batch. */
+		offered = iov_bytes(ul);
+		msg.msg_iov = ul->iov;
+		msg.msg_iovlen = ul->iov_count;
+		sent = sendmsg(ul->fd, &msg, 0);
+		if (sent < 0 && (errno == EOPNOTSUPP || errno == ENOTSUP)) {
+			/* No gather support, one buffer at a time */
+			offered = ul->iov[0].iov_len;
+			sent = send(ul->fd, ul->iov[0].iov_base,
+				    ul->iov[0].iov_len, 0);
 		}
-	}
-
-	err = url_parse_port(host, &port);
-	if (err) {
-		switch (dl->proto) {
-		case IPPROTO_TLS_1_2:
-			port = 443;
-			break;
-		case IPPROTO_TCP:
-			port = 80;
-			break;
-		case IPPROTO_DTLS_1_2:
-			port = 5684;
-			break;
-		case IPPROTO_UDP:
-			port = 5683;
-			break;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Continue when the socket is writable again */
+			return 0;
 		}
-		//printk("Port not specified, using default: %d", port);
-	}
-
-	switch (sa->sa_family) {
-	case AF_INET6:
-		SIN6(sa)->sin6_port = htons(port);
-		addrlen = sizeof(struct sockaddr_in6);
-		break;
-	case AF_INET:
-		SIN(sa)->sin_port = htons(port);
-		addrlen = sizeof(struct sockaddr_in);
-		break;
-	default:
-		return -EAFNOSUPPORT;
-	}
-
-	*fd = socket(sa->sa_family, type, dl->proto);
-	if (*fd < 0) {
-		printk("Failed to create socket, err %d", errno);
-		return -errno;
-	}
-
-	if (dl->config.apn != NULL && strlen(dl->config.apn)) {
-		err = socket_apn_set(*fd, dl->config.apn);
-		if (err) {
-			goto cleanup;
+		if (sent <= 0) {
+			printk("Failed to send upload data, errno %d\n", errno);
+			evt_err.error = -ECONNRESET;
+			evt_send(ul, &evt_err);
+			return 1;
 		}
-	}
 
-	if ((dl->proto == IPPROTO_TLS_1_2 || dl->proto == IPPROTO_DTLS_1_2)
-#ifdef USE_SEC_TAG_ARRAY
-	     && (dl->config.sec_tag_array != NULL)) {
-		err = socket_sectag_set(*fd, dl->config.sec_tag_array, dl->config.sec_tag_array_sz);
-#else
-		 && (dl->config.sec_tag != -1)) {
-		err = socket_sectag_set(*fd, dl->config.sec_tag);		
-#endif
-		if (err) {
-			goto cleanup;
+		if (ul->send_calls == 0) {
+			/* The header goes out with the first payload */
+			transport_timing_mark(&ul->timing,
+					      TRANSPORT_PHASE_REQUEST_SENT);
+			transport_timing_mark(&ul->timing,
+					      TRANSPORT_PHASE_FIRST_BYTE);
 		}
+		ul->send_calls++;
+		ul->progress += sent;
+		if (ul->config.throughput) {
+			throughput_add(ul->config.throughput, sent);
+		}
+		iov_consume(ul, sent);
+		chunk_adapt(ul, offered, sent);
 	}
-
-	//LOG_INF("Connecting to %s", log_strdup(host));
-	//LOG_DBG("fd %d, addrlen %d, fam %s, port %d", *fd, addrlen, str_family(sa->sa_family), port);
-
-	err = connect(*fd, sa, addrlen);
-	if (err) {
-		//LOG_ERR("Unable to connect, errno %d", errno);
-		printk("Unable to connect, errno %d\n", errno);
-		err = -errno;
-	}
-
-cleanup:
-	if (err) {
-		/* Unable to connect, close socket */
-		close(*fd);
-		*fd = -1;
-	}
-
-	return err;
 }
 
-static int socket_send(const int fd, const char* buf, size_t len)
+/* Returns:
+ *  1 while the response is being received
+ *  0 once the response is complete
+ *  a negative error code otherwise
+ */
+static int response_parse(struct upload_client *ul, bool closed)
 {
-	int sent;
-	size_t off = 0;
+	char *p;
+	char *end;
+	char *body;
+	size_t hdr_len;
+	unsigned long size;
+	bool complete;
 
-	while (len) {
-		sent = send(fd, buf + off, len, 0);
-		if (sent <= 0) {
-			return -errno;
-		}
-
-		off += sent;
-		len -= sent;
+	p = strstr(ul->buf, "\r\n\r\n");
+	if (!p) {
+		/* Waiting full HTTP header */
+		return 1;
 	}
 
-	return 0;
-}
+	hdr_len = p + strlen("\r\n\r\n") - ul->buf;
+	body = ul->buf + hdr_len;
 
-#define POST_HTTPS_TEMPLATE_PREAMBLE                                      \
-		"POST /%s HTTP/1.1\r\n"                                                 \
-		"Host: %s\r\n"                                                         \
-		"User-Agent: nRF91/0.1\r\n"                                           \
-		"Accept: */*\r\n"															\
-		"Content-Length: %d\r\n"													\
-		"Content-Type: multipart/form-data; "									\
-		"boundary=------------------------76a17771c6949e06\r\n\r\n"						
-	#define POST_HTTPS_TEMPLATE_MIDAMBLE									\
-		"------------------------76a17771c6949e06\r\n"								\
-		"Content-Disposition: form-data; name=\"filename\"; filename=\"test5.dat\"\r\n" \
-		"Content-Type: application/octet-stream\r\n\r\n"								
-
-	#define POST_HTTPS_TEMPLATE_POSTAMBLE										\
-		"--------------------------76a17771c6949e06--\r\n"                         
-
-static int http_post_request_send(struct upload_client *client)
-{
-	int err;
-	int len;
-	//size_t off;
-	char host[HOSTNAME_SIZE];
-	char file[FILENAME_SIZE];
+	for (size_t i = 0; i < hdr_len; i++) {
+		ul->buf[i] = tolower(ul->buf[i]);
+	}
 
-	__ASSERT_NO_MSG(client->host);
-	__ASSERT_NO_MSG(client->file);
+	p = strstr(ul->buf, "connection: close");
+	ul->http.connection_close = (p && p < body);
 
-	err = url_parse_host(client->host, host, sizeof(host));
-	if (err) {
-		return err;
+	if (strncmp(ul->buf, "http/1.", strlen("http/1.")) ||
+	    hdr_len < strlen("http/1.1 200")) {
+		printk("Malformed upload response\n");
+		return -EBADMSG;
 	}
 
-	err = url_parse_file(client->file, file, sizeof(file));
-	if (err) {
-		return err;
+	ul->http.response.status = atoi(ul->buf + strlen("http/1.1 "));
+	if (ul->http.response.status < 200 || ul->http.response.status > 299) {
+		printk("Upload response is HTTP %d\n",
+		       ul->http.response.status);
+		return -EBADMSG;
 	}
 
-	/* We use range requests only for HTTPS, due to memory limitations.
-	 * When using HTTP, we request the whole resource to minimize
-	 * network usage (only one request/response are sent).
+	/* The body is complete when the connection closes or
+	 * Content-Length bytes have arrived.
 	 */
-	if (client->proto == IPPROTO_TLS_1_2) {
-		len = snprintf(client->buf,
-			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-			//POST_HTTPS_TEMPLATE, file, host, client->progress, off);
-			POST_HTTPS_TEMPLATE_PREAMBLE, file, host, (client->file_size+208));
-	} else {
-		len = snprintf(client->buf,
-			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-			POST_HTTPS_TEMPLATE_PREAMBLE, file, host, (client->file_size+208));
+	p = strstr(ul->buf, "content-length:");
+	complete = closed ||
+		   (p && p < body &&
+		    ul->offset - hdr_len >=
+		    (size_t)atoi(p + strlen("content-length:")));
+
+	/* upload.php answers "size=<bytes received>" */
+	p = strstr(body, "size=");
+	if (p) {
+		size = strtoul(p + strlen("size="), &end, 10);
+		/* Unless the body is complete, the number may still
+		 * be arriving.
+		 */
+		if (*end != '\0' || complete) {
+			ul->http.response.size = size;
+			return 0;
+		}
 	}
 
-	if (len < 0 || len > CONFIG_DOWNLOAD_CLIENT_BUF_SIZE) {
-		printk("Cannot create GET request, buffer too small");
-		return -ENOMEM;
-	}
+	return complete ? 0 : 1;
+}
 
-#if 0
-	if (IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_LOG_HEADERS)) {
-		//LOG_HEXDUMP_DBG(client->buf, len, "HTTP request");
-	}
-#endif
+/* Receive the response to the upload.
+ * Returns non-zero when the upload is over.
+ */
+static int response_recv(struct upload_client *ul)
+{
+	int rc;
+	ssize_t len;
+	bool closed;
+	struct upload_client_evt evt;
+
+	while (true) {
+		len = recv(ul->fd, ul->buf + ul->offset,
+			   CONFIG_DOWNLOAD_CLIENT_BUF_SIZE - 1 - ul->offset, 0);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (len < 0) {
+			printk("Failed to receive upload response, errno %d\n",
+			       errno);
+			rc = -ECONNRESET;
+			break;
+		}
 
-	/* Send preamble*/
-	err = socket_send(client->fd, client->buf, len);
-	if (err) {
-		printk("Failed to send HTTP POST pre-amble, errno %d", errno);
-		return err;
-	}
+		closed = (len == 0);
+		ul->offset += len;
+		ul->buf[ul->offset] = '\0';
 
-	len = snprintf(client->buf,
-			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-			POST_HTTPS_TEMPLATE_MIDAMBLE);
-	
-	if (len < 0 || len > CONFIG_DOWNLOAD_CLIENT_BUF_SIZE) {
-		printk("Cannot create GET request, buffer too small");
-		return -ENOMEM;
+		rc = response_parse(ul, closed);
+		if (rc == 1 && closed) {
+			rc = -ECONNRESET;
+		} else if (rc == 1 &&
+			   ul->offset == CONFIG_DOWNLOAD_CLIENT_BUF_SIZE - 1) {
+			rc = -E2BIG;
+		}
+		if (rc != 1) {
+			break;
+		}
 	}
 
-	/* Send mid-amble*/
-	err = socket_send(client->fd, client->buf, len);
-	if (err) {
-		printk("Failed to send HTTP POST mid-amble, errno %d", errno);
-		return err;
+	ul->http.response_pending = false;
+
+	if (rc) {
+		evt.id = UPLOAD_CLIENT_EVT_ERROR;
+		evt.error = rc;
+		evt_send(ul, &evt);
+		return 1;
 	}
 
-	return 0;
-}
+	ul->posts++;
+	transport_timing_mark(&ul->timing, TRANSPORT_PHASE_LAST_BYTE);
 
-static int request_send(struct upload_client *dl)
-{
-	switch (dl->proto) {
-		case IPPROTO_TCP:
-		case IPPROTO_TLS_1_2: {
-			return http_post_request_send(dl);
+	evt.id = UPLOAD_CLIENT_EVT_RESPONSE;
+	evt.response = ul->http.response;
+	if (evt_send(ul, &evt) == 0 && !ul->http.connection_close) {
+		/* Post the same amount again, on the same connection */
+		rc = request_send(ul);
+		if (rc == 0) {
+			event_loop_session_set(&ul->session, POLLOUT,
+					       session_deadline());
+			return 0;
 		}
-		case IPPROTO_UDP:
-		case IPPROTO_DTLS_1_2:
-			break;
+		evt.id = UPLOAD_CLIENT_EVT_ERROR;
+		evt.error = rc;
+		evt_send(ul, &evt);
+		return 1;
 	}
 
-	return 0;
-}
-
-static int fragment_evt_send(struct upload_client *client, struct upload_client_evt *evt)
-{
-	__ASSERT(client->offset <= CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-		 "Buffer overflow!");
+	evt.id = UPLOAD_CLIENT_EVT_DONE;
+	evt.response = ul->http.response;
+	evt_send(ul, &evt);
 
-	evt->id = UPLOAD_CLIENT_EVT_FRAGMENT;
-	evt->fragment.buf = 0;
-	evt->fragment.len = 0;	
-	return client->callback(evt);
+	return 1;
 }
 
-void upload_thread(void *client, void *a, void *b)
+static void upload_handler(struct event_loop_session *session, int revents)
 {
-	int rc = 0;
-	size_t len;
-	struct upload_client *const ul = client;
-	struct upload_client_evt upload_fragment_evt;
-	struct upload_client_evt evt_done = {
-				.id = UPLOAD_CLIENT_EVT_DONE,
-			};
+	int rc;
+	struct upload_client *const ul =
+		CONTAINER_OF(session, struct upload_client, session);
 	struct upload_client_evt evt_err = {
 				.id = UPLOAD_CLIENT_EVT_ERROR,
+				.error = -ETIMEDOUT,
 			};
-restart_and_suspend:
-	k_thread_suspend(ul->tid);
 
-		/* Ask for buffer from the application.
-		 * If the application callback returns non-zero, stop.
-		 */
-		
-		while((rc = fragment_evt_send(ul,  &upload_fragment_evt)) == 0) {
-			/* Send out buffer. */
-			rc = socket_send(ul->fd, upload_fragment_evt.fragment.buf, upload_fragment_evt.fragment.len);
-			if (rc) {				
-				printk("Failed to send upload data, errno %d", errno);
-				goto restart_and_suspend;
-			}
+	if (revents == 0) {
+		if (ul->http.response_pending) {
+			printk("No upload response in %d ms\n",
+			       CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS);
+		} else {
+			printk("Upload socket not writable in %d ms\n",
+			       CONFIG_DOWNLOAD_CLIENT_SOCK_TIMEOUT_MS);
 		}
-
-		/* Send postamble. */
-		len = snprintf(ul->buf,
-			CONFIG_DOWNLOAD_CLIENT_BUF_SIZE,
-			POST_HTTPS_TEMPLATE_POSTAMBLE);
-	
-		if (len < 0 || len > CONFIG_DOWNLOAD_CLIENT_BUF_SIZE) {
-			printk("Cannot create postamble request, buffer too small\n");
-			ul->callback(&evt_err);
-			goto restart_and_suspend; 
+		ul->http.response_pending = false;
+		evt_send(ul, &evt_err);
+		rc = 1;
+	} else if (!ul->http.response_pending) {
+		rc = upload_send(ul);
+		if (rc == 0 && !ul->http.response_pending &&
+		    session->events) {
+			/* Waiting for room in the socket again, unless paused */
+			session->deadline = session_deadline();
 		}
-		rc = socket_send(ul->fd, ul->buf, len);
-		if (rc) {
-			printk("Failed to send upload postamble data, errno %d", errno);
-			ul->callback(&evt_err);
-			goto restart_and_suspend; 
+	} else {
+		rc = response_recv(ul);
+		if (rc == 0 && ul->http.response_pending) {
+			session->deadline = session_deadline();
 		}
+	}
 
-		
-		ul->callback(&evt_done);
-		
-	/* Do not let the thread return, since it can't be restarted */
-	goto restart_and_suspend;
+	if (rc) {
+		/* Idle until the upload is started again */
+		event_loop_remove(session);
+	}
 }
 
 int upload_client_init(struct upload_client *const client,
@@ -465,18 +462,25 @@ int upload_client_init(struct upload_client *const client,
 		return -EINVAL;
 	}
 
+	/* Sockets are serviced by the event loop once an upload starts */
+	event_loop_remove(&client->session);
+
+	/* A client initialized before may still hold a socket and a buffer */
+	if (client->initialized) {
+		if (client->fd >= 0) {
+			close(client->fd);
+		}
+		transport_buf_release(client->buf);
+	}
+
+	client->session.fd = -1;
+	client->session.handler = upload_handler;
+	client->initialized = true;
+
 	client->fd = -1;
+	client->buf = NULL;
 	client->callback = callback;
 
-	/* The thread is spawned now, but it will suspend itself;
-	 * it is resumed when the upload is started via the API.
-	 */
-	client->tid =
-		k_thread_create(&client->thread, client->thread_stack,
-				K_THREAD_STACK_SIZEOF(client->thread_stack),
-				upload_thread, client, NULL, NULL,
-				K_LOWEST_APPLICATION_THREAD_PRIO, 0, K_NO_WAIT);
-
 	return 0;
 }
 
@@ -484,7 +488,7 @@ int upload_client_connect(struct upload_client *client, const char *host,
 			    const struct upload_client_cfg *config)
 {
 	int err;
-	struct sockaddr sa;
+	struct transport_cfg cfg;
 
 	if (client == NULL || host == NULL || config == NULL) {
 		return -EINVAL;
@@ -495,25 +499,6 @@ int upload_client_connect(struct upload_client *client, const char *host,
 		return 0;
 	}
 
-#if 0
-	if (config->frag_size_override > CONFIG_DOWNLOAD_CLIENT_BUF_SIZE) {
-		//LOG_ERR("The configured fragment size is larger than buffer");
-		return -E2BIG;
-	}
-#endif
-
-	/* Attempt IPv6 connection if configured, fallback to IPv4 */
-	if (IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_IPV6)) {
-		err = host_lookup(host, AF_INET6, config->apn, &sa);
-	}
-	if (err || !IS_ENABLED(CONFIG_DOWNLOAD_CLIENT_IPV6)) {
-		err = host_lookup(host, AF_INET, config->apn, &sa);
-	}
-
-	if (err) {
-		return err;
-	}
-
 	client->config = *config; /* Shallow copy primitives. */
 #ifdef USE_SEC_TAG_ARRAY
 	/* Deep copy array fields */
@@ -523,25 +508,43 @@ int upload_client_connect(struct upload_client *client, const char *host,
 #endif
 	client->host = host;
 
-	err = client_connect(client, host, &sa, &client->fd);
-	if (client->fd < 0) {
-		return err;
-	}
-
-	/* Set socket timeout, if configured */
-	err = socket_timeout_set(client->fd);
+	err = url_parse(host, &client->url);
 	if (err) {
+		printk("Invalid URL %s, err %d\n", host, err);
 		return err;
 	}
 
-	return 0;
+	cfg = (struct transport_cfg) {
+		.apn = client->config.apn,
+#ifdef USE_SEC_TAG_ARRAY
+		.sec_tag_array = client->config.sec_tag_array,
+		.sec_tag_array_sz = client->config.sec_tag_array_sz,
+#else
+		.sec_tag_array = (client->config.sec_tag != -1) ?
+				 &client->config.sec_tag : NULL,
+		.sec_tag_array_sz = 1,
+#endif
+	};
+
+	return transport_connect(&client->url, &cfg, &client->proto,
+				 &client->fd, &client->timing);
 }
 
 int upload_client_disconnect(struct upload_client *const client)
 {
 	int err;
 
-	if (client == NULL || client->fd < 0) {
+	if (client == NULL) {
+		return -EINVAL;
+	}
+
+	event_loop_remove(&client->session);
+
+	/* Hand the buffer back for other sessions to use */
+	transport_buf_release(client->buf);
+	client->buf = NULL;
+
+	if (client->fd < 0) {
 		return -EINVAL;
 	}
 
@@ -569,34 +572,63 @@ int upload_client_start(struct upload_client *client, const char *file,
 		return -ENOTCONN;
 	}
 
+	/* Wait for the handler of the previous upload to return */
+	event_loop_remove(&client->session);
+
+	if (client->buf == NULL) {
+		client->buf = transport_buf_lease();
+		if (client->buf == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	err = url_parse_file(file, client->url.path, sizeof(client->url.path));
+	if (err) {
+		printk("Invalid file name %s, err %d\n", file, err);
+		return err;
+	}
+
 	client->file = file;
 	client->file_size = file_size;
 	client->progress = from;
 
-	client->offset = 0;
+	client->iov_count = 0;
+	client->posts = 0;
+	client->send_calls = 0;
+	client->chunk_size = CONFIG_UPLOAD_CLIENT_CHUNK_MIN;
+	client->chunk_size_peak = client->chunk_size;
 	client->http.has_header = false;
+	client->http.response_pending = false;
+	client->http.connection_close = false;
+	transport_timing_reset(&client->timing, TRANSPORT_PHASE_REQUEST_SENT);
 
 	err = request_send(client);
 	if (err) {
 		return err;
 	}
 
-	//LOG_INF("Downloading: %s [%u]", log_strdup(client->file),	client->progress);
+	/* Let the event loop send the body */
+	client->session.fd = client->fd;
+	client->session.events = POLLOUT;
+	client->session.deadline = session_deadline();
 
-	/* Let the thread run */
-	k_thread_resume(client->tid);
-
-	return 0;
+	return event_loop_add(&client->session);
 }
 
 void upload_client_pause(struct upload_client *client)
 {
-	k_thread_suspend(client->tid);
+	event_loop_session_set(&client->session, 0, 0);
 }
 
 void upload_client_resume(struct upload_client *client)
 {
-	k_thread_resume(client->tid);
+	if (client->http.response_pending) {
+		event_loop_session_set(&client->session, POLLIN,
+				       session_deadline());
+	} else {
+		event_loop_session_set(&client->session, POLLOUT,
+				       session_deadline());
+	}
 }
 
 int upload_client_file_size_get(struct upload_client *client, size_t *size)
@@ -609,3 +641,15 @@ int upload_client_file_size_get(struct upload_client *client, size_t *size)
 
 	return 0;
 }
+
+int upload_client_timing_get(struct upload_client *client,
+			     struct transport_timing *timing)
+{
+	if (!client || !timing) {
+		return -EINVAL;
+	}
+
+	*timing = client->timing;
+
+	return 0;
+}